@@ -24,22 +24,98 @@ ALL COMPLETE !!!!
 #include "allocator.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include <assert.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <execinfo.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define INDEX_SIMD  // SSE4.1/AVX2 best-fit kernels, picked at run time
+#endif
 
 #define FREE_HEADER_SIZE  sizeof(struct free_list_header)  
 #define ALLOC_HEADER_SIZE sizeof(struct alloc_block_header)  
 #define MAGIC_FREE     0xDEADBEEF
 #define MAGIC_ALLOC    0xBEEFDEAD
+#define MAGIC_CACHED   0xBEEFCAFE
+#define MAGIC_HANDLE   0xBEEFFACE
+#define MAGIC_MMAP     0xBEEFF00D
+#define MAGIC_QUEUED   0xBEEFD00D  // on a remote_free_head stack, not yet drained
 
 // my defines
 #define MIN_MEMORY 16
 #define TRUE 1
 #define FALSE 0
-#define THRESHOLD (n + 2*FREE_HEADER_SIZE)
+#define THRESHOLD (n + arena->split_min)
+#define REALLOC_ALIGN 16  // alignment kept by vlad_realloc (malloc's, on x86-64)
+#define MAX_REQUEST ((u_int32_t) -1 - ALLOC_HEADER_SIZE - MIN_MEMORY)  // largest n blockSize can hold
 
-#define BEST_FIT       1
-#define WORST_FIT      2
-#define RANDOM_FIT     3
+#define BEST_FIT       VLAD_BEST_FIT
+#define WORST_FIT      VLAD_WORST_FIT
+#define RANDOM_FIT     VLAD_RANDOM_FIT
+#define FIRST_FIT      VLAD_FIRST_FIT
+#define SPLIT_MIN      (2*FREE_HEADER_SIZE)  // default smallest split remainder
+
+// adaptive placement (see adaptPolicy)
+#define ADAPT_WINDOW     1024  // # searches between decisions
+#define ADAPT_FRAG_HIGH  50    // % of free space outside the largest block
+#define ADAPT_FRAG_LOW   20
+#define ADAPT_STEPS      32    // mean free blocks looked at per search
+#define ADAPT_FREE_LOW   8     // under 1/8 of memory[] free is "under pressure"
+#define ADAPT_FREE_HIGH  4     // split_min rises only with 1/4 of memory[] free
+#define ADAPT_CALM       16    // ... and after this many windows without pressure
+
+#define NO_HINT        0     // a request with no lifetime hint (best fit)
+
+// quick-reuse cache used in lazy coalescing mode
+// one bin for each block size from MIN_MEMORY to CACHE_MAX_SIZE
+#define CACHE_MAX_SIZE 1024
+#define CACHE_BINS     ((CACHE_MAX_SIZE - MIN_MEMORY) / 4 + 1)
+#define NO_BLOCK       0xFFFFFFFF
+
+// multi-arena mode
+#define MAX_ARENAS       64
+#define ARENA_SHIFT      24  // a handle holds arena << ARENA_SHIFT | slot + 1
+#define CONTENTION_LIMIT 8   // # busy locks before a thread changes arena
+
+// leak report: # blocks of each size class listed by vlad_end
+#define LEAK_LIST        16
+
+// huge blocks (vlad_set_mmap_threshold)
+#define HUGE_HEADER_SIZE sizeof(struct huge_block_header)
+#define HUGE_SLOTS       64    // first size of huge_table[] (a power of two)
+#ifndef MREMAP_MAYMOVE
+#define MREMAP_MAYMOVE   1     // as in <sys/mman.h> with _GNU_SOURCE
+#endif
+
+// returning idle free pages to the OS (vlad_set_decay)
+#define PAGE_CLEAN       0     // page_idle[] of a page with nothing to return
+#define PURGE_STEP       (1 << 20)  // most bytes the purge thread returns per vlad_purge
+#ifndef CLOCK_MONOTONIC_COARSE
+#define CLOCK_MONOTONIC_COARSE CLOCK_MONOTONIC  // Linux's is cheaper, to the tick
+#endif
+
+// heap profiler
+#define PROFILE_DEPTH    32    // most frames kept per sample
+#define PROFILE_SKIP     1     // frames inside Vlad: profileAlloc itself
+#define PROFILE_SLOTS    1024  // first size of samples[]
+
+// free-list index
+#define INDEX_SLOTS      64    // first size of index_sizes[]/index_offsets[]
+#define INDEX_BYTES(slots) ((slots) * (sizeof(vsize_t) + sizeof(vaddr_t) + 2 * sizeof(u_int32_t)))
+#define INDEX_SIMD_MIN   32    // fewest entries worth a vector search
+
+// NUMA memory policy for mbind(2), as in <numaif.h>
+#define MPOL_BIND        2
+#define NODE_LIST        "/sys/devices/system/node/online"
 
 typedef unsigned char byte;
 typedef u_int32_t vsize_t;
@@ -58,22 +134,269 @@ typedef struct alloc_block_header {
     vsize_t size;     // # bytes in this block (including header)
 } alloc_header_t;
 
+// a block with a mapping of its own, outside every arena
+// the last two fields are where an alloc_header_t would be
+typedef struct huge_block_header {
+    struct huge_block_header *next;  // list of every huge block
+    struct huge_block_header *prev;
+    size_t length;    // # bytes mapped
+    u_int32_t magic;  // ought to contain MAGIC_MMAP
+    u_int32_t requested; // # bytes requested
+} huge_header_t;
+
 // Global data
+//
+// Each arena is a separate memory[] with its own free list, cache and lock.
+// vlad_init sets up one arena; vlad_init_arenas sets up several, and each
+// thread allocates from its own "home" arena.
+
+typedef struct vlad_arena {
+    byte *start;              // pointer to start of allocator memory
+    int node;                 // NUMA node memory[] is bound to (-1 = none)
+    vsize_t mapped;           // # bytes mmap'd for memory[]
+
+    // heap state: every field from free_list up to (not including) handles
+    // is plain data, saved and restored as one block by vlad_snapshot
+
+    vaddr_t free_list;        // index in memory[] of first block in free list
+    vsize_t size;             // number of bytes malloc'd in memory[]
+    u_int32_t policy;         // allocation strategy (by default BEST_FIT)
+    u_int32_t adaptive;       // TRUE if adaptPolicy picks policy and split_min
+    vsize_t split_min;        // smallest remainder a split may leave
+    vsize_t split_low;        // range adaptPolicy keeps split_min in
+    vsize_t split_high;
+    u_int32_t seed;           // state of the RANDOM_FIT generator
+    u_int32_t calm;           // # windows since the arena was under pressure
+
+    // what searches of the free list have seen since adaptPolicy last ran
+    u_int32_t window_searches;
+    u_int32_t window_steps;   // # free blocks looked at
+    u_int32_t window_failures;// # searches that found no block
+    u_int64_t window_bytes;   // total size of the blocks searched for
+    vaddr_t dirty;            // memory[] index past the last byte ever handed out
+                              // from the low end...
+    vaddr_t dirty_top;        // ... and of the first from the high end
+    vaddr_t victim;           // remainder of the last split (NO_BLOCK = none)
+    vsize_t victim_max;       // largest block carved from it (0 = never)
+    vaddr_t permanent_floor;  // lowest VLAD_PERMANENT block ever placed
+
+    vaddr_t bins[CACHE_BINS]; // memory[] index of first cached block of each size
+    vsize_t cached;           // total size of the blocks held in bins[]
+    vsize_t budget;           // most bytes bins[] may hold (0 = eager coalescing)
+
+    u_int32_t splits;         // # free blocks split by vlad_malloc
+    u_int32_t merges;         // # pairs of free blocks merged by vlad_merge
+    u_int32_t hits;           // # vlad_malloc requests served from bins[]
+
+    u_int32_t handle_slots;   // # entries in handles[] (NO_BLOCK = unused)
+    u_int32_t handle_hint;    // where to start looking for an unused entry
+
+    vaddr_t *handles;         // memory[] index of the block behind each handle
+
+    // optional index of the free list (see vlad_set_index), NULL if off
+    vsize_t *index_sizes;     // size of each free block, in no order
+    vaddr_t *index_offsets;   // its memory[] index
+    u_int32_t *index_table;   // 2 * index_slots: entry + 1 by hash of its offset (0 = none)
+    u_int32_t index_count;    // # entries in use
+    u_int32_t index_slots;    // # entries in each array
+    u_int32_t index_lost;     // # times the index was dropped for lack of memory
+
+    // when each page of memory[] last joined a free block, in ms on the
+    // coarse monotonic clock (see vlad_set_decay), NULL if off
+    u_int64_t *page_idle;     // PAGE_CLEAN = not touched since returned
+    u_int32_t pages;          // # entries in page_idle[]
+
+    // stack of blocks freed by other threads, linked like bins[]
+    // pushed with a single CAS, drained all at once by the lock holder
+    _Atomic vaddr_t remote_frees;
+
+    pthread_mutex_t lock;     // held by the thread working on this arena
+    _Atomic u_int32_t contention; // # times a thread found lock already held
+} arena_t;
+
+#define STATE_START  offsetof(arena_t, free_list)
+#define STATE_SIZE   (offsetof(arena_t, handles) - STATE_START)
+
+// saved copy of every arena, made by vlad_snapshot
+struct vlad_snapshot {
+    u_int32_t num_arenas;
+    struct saved_arena {
+        arena_t state;        // only the heap state fields are used
+        byte *bytes;          // copy of memory[] (mmap'd, with handles)
+        vaddr_t *handles;     // copy of handles[], just after bytes
+    } saved[];
+};
+
+// a sampled allocation, kept by vlad_profile until its block is freed
+typedef struct sample {
+    u_int32_t arena;          // index in arenas[] + 1 (0 = unused entry)
+    vaddr_t offset;           // memory[] index of the block
+    vsize_t size;             // # bytes requested
+    u_int32_t weight;         // # blocks like it this sample stands for
+    u_int32_t depth;          // # return addresses in stack[]
+    void *stack[PROFILE_DEPTH];
+} sample_t;
+
+static arena_t arenas[MAX_ARENAS];
+static u_int32_t num_arenas;  // # arenas set up by vlad_init
+static u_int32_t granule = 4; // every block size is a multiple of this (vlad_set_granule)
+
+// bytes mapped in front of each memory[], so that the first block's
+// payload (and so, with sizes a multiple of granule, every block's) is
+// aligned to granule
+#define MAP_LEAD ((granule - ALLOC_HEADER_SIZE % granule) % granule)
+
+static _Thread_local arena_t *arena = &arenas[0]; // arena being worked on
+static _Thread_local arena_t *home_arena = NULL;  // arena this thread allocates from
+static _Thread_local u_int32_t home_misses;       // # times home_arena was busy
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic u_int32_t profile_rate;    // bytes per sample (0 = not profiling)
+static sample_t *samples;                 // hash table of samples (linear probing)
+static u_int32_t sample_slots;            // # entries in samples[]
+static _Atomic u_int32_t sample_count;    // # entries in use
+static _Thread_local int64_t profile_countdown; // bytes until this thread samples
+
+static pthread_mutex_t huge_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic u_int32_t huge_threshold;  // smallest request given its own mmap (0 = none)
+static huge_header_t *huge_list;          // every huge block
+static huge_header_t **huge_table;        // hash table of them by header (linear probing)
+static u_int32_t huge_slots;              // # entries in huge_table[]
+static u_int32_t huge_count;              // # huge blocks
+static u_int64_t huge_bytes;              // total length of their mappings
 
-static byte *memory = NULL;   // pointer to start of allocator memory
-static vaddr_t free_list_ptr; // index in memory[] of first block in free list
-static vsize_t memory_size;   // number of bytes malloc'd in memory[]
-static u_int32_t strategy;    // allocation strategy (by default BEST_FIT)
+static _Atomic u_int32_t purge_decay;     // ms a page must be idle to be returned (0 = never)
+static u_int32_t page_shift;              // log2 of the page size (set by initArenas)
+static pthread_mutex_t purge_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t purge_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t purge_thread;
+static u_int32_t purge_interval;          // ms between the thread's purges (0 = no thread)
+
+// the best-fit search used on a large free-list index (set by chooseBestFit)
+static int (*best_fit)(const vsize_t *sizes, u_int32_t count, vsize_t n);
+
+static FILE *leak_report;                 // where vlad_end lists leaks (NULL = nowhere)
+
+// The allocator's state used to be a set of globals. These names now refer
+// to the fields of the arena being worked on, so the code below (and the
+// unit tests, which read memory[] and free_list_ptr directly) are unchanged.
+
+#define memory            (arena->start)
+#define free_list_ptr     (arena->free_list)
+#define memory_size       (arena->size)
+#define strategy          (arena->policy)
+#define dirty_end         (arena->dirty)
+#define cache_bin         (arena->bins)
+#define cache_bytes       (arena->cached)
+#define cache_budget      (arena->budget)
+#define remote_free_head  (arena->remote_frees)
+#define split_count       (arena->splits)
+#define merge_count       (arena->merges)
+#define cache_hits        (arena->hits)
 
 // Private functions
 
 static void vlad_merge();
+static int initArenas(vsize_t size, u_int32_t n, const int *nodes);
+static int initArena(vsize_t size, int node);
+static u_int32_t onlineNodes(int *nodes, u_int32_t max);
+static int currentNode(void);
+static arena_t *lockHomeArena(void);
+static arena_t *findArena(void *object);
+static void *allocate(u_int32_t n, int lifetime, vaddr_t *clean);
+static void *allocateIn(arena_t *owner, u_int32_t n);
+static void *alignedAlloc(arena_t *only, u_int32_t alignment, u_int32_t n);
+static void *arenaMalloc(u_int32_t n, int lifetime);
+static void arenaFree(void *object);
+static void checkArena(vlad_report_t *report);
+static void statsArena(void);
+static int mapArena(FILE *out, int format, u_int32_t index);
+static free_header_t *takeBlock(vsize_t n);
+static free_header_t *takeHinted(vsize_t n, int lifetime);
+static u_int64_t hintedRank(vaddr_t offset, vsize_t size, int lifetime);
+static void unlinkFree(free_header_t *block);
+static void releaseBlock(free_header_t *freePtr);
+static void flushCache(void);
+static void cacheBlock(alloc_header_t *block);
+static vlink_t *cacheLink(void *block);
+static void drainRemoteFrees(void);
+static void lockAll(void);
+static void unlockAll(void);
+static vsize_t compactArena(vsize_t budget);
+static void moveFreeHeader(vaddr_t from, vaddr_t to, vsize_t size,
+                           vlink_t next, vlink_t prev);
+static int growInPlace(alloc_header_t *block, vsize_t n);
+static void markDirty(vaddr_t start, vaddr_t end);
+static vsize_t purgeArena(vsize_t budget);
+static int buildPageIdle(void);
+static void dropPageIdle(void);
+static void idleFreeList(vaddr_t clean, vaddr_t cleanEnd);
+static void idlePages(vaddr_t offset, vsize_t size);
+static u_int64_t msNow(void);
+static void *purgeThread(void *unused);
+static void stopPurgeThread(void);
+static int buildIndex(void);
+static void dropIndex(void);
+static int growIndex(void);
+static void indexAdd(vaddr_t offset, vsize_t size);
+static void indexMove(vaddr_t from, vaddr_t to, vsize_t size);
+static void indexDrop(vaddr_t offset);
+static void indexRemove(u_int32_t i);
+static int indexFind(vaddr_t offset);
+static u_int32_t indexSlot(vaddr_t offset);
+static u_int32_t indexHash(vaddr_t offset);
+static void indexLink(u_int32_t i);
+static void indexUnlink(u_int32_t i);
+static void indexSet(u_int32_t i, vaddr_t offset, vsize_t size);
+static int indexBestFit(vsize_t n);
+static int indexFit(vsize_t n);
+static int betterFit(vsize_t size, vsize_t best, u_int32_t fits);
+static void countSearch(vsize_t n, u_int32_t steps, int found);
+static void adaptPolicy(void);
+static void chooseBestFit(void);
+static int scanBestFit(const vsize_t *sizes, u_int32_t count, vsize_t n);
+static int finishBestFit(const vsize_t *sizes, u_int32_t count, vsize_t n,
+                         u_int32_t from, const vsize_t *laneSizes,
+                         const u_int32_t *laneEntries, u_int32_t lanes);
+#ifdef INDEX_SIMD
+static int bestFitSSE41(const vsize_t *sizes, u_int32_t count, vsize_t n);
+static int bestFitAVX2(const vsize_t *sizes, u_int32_t count, vsize_t n);
+#endif
+static int growHandles(u_int32_t slots);
+static void dropHandles(void);
+static arena_t *handleArena(vlad_handle_t handle);
+static int wantHuge(u_int32_t n);
+static void *hugeAlloc(u_int32_t alignment, u_int32_t n);
+static huge_header_t *findHuge(void *object);
+static int addHuge(huge_header_t *header);
+static void dropHuge(huge_header_t *header);
+static int growHugeTable(void);
+static u_int32_t hugeHash(huge_header_t *header);
+static byte *hugeBase(huge_header_t *header);
+static int freeHuge(void *object);
+static int reallocHuge(void *object, u_int32_t n, void **moved);
+static void profileAlloc(void *object, u_int32_t n);
+static void profileFree(void *object);
+static sample_t *findSample(u_int32_t index, vaddr_t offset);
+static void dropSample(u_int32_t i);
+static void reportLeaks(FILE *out);
+static void listLeaks(FILE *out, u_int32_t class);
+static void growSamples(void);
+static void clearSamples(void);
+static u_int32_t sampleHash(u_int32_t index, vaddr_t offset);
+static int compareStacks(const void *a, const void *b);
+static int isBlockMagic(u_int32_t magic);
 static vsize_t powerOfTwo(vsize_t);
 static vsize_t multipleOfFour(vsize_t n);
+static vsize_t blockSize(vsize_t n);
 static void *makeRealPtr(vaddr_t ptr);
 static vaddr_t makeOffsetPtr(void *ptr);
 static void checkHeader(void *ptr);
 static u_int32_t adjacent(free_header_t *ptr);
+static void reportError(vlad_report_t *report, vaddr_t offset, const char *message);
+static void printRun(FILE *out, int format, int first, int isFree,
+                     vaddr_t offset, vsize_t size, u_int32_t blocks);
+static u_int32_t sizeClass(u_int64_t size);
 
 // Input: size - number of bytes to make available to the allocator
 // Output: none              
@@ -86,21 +409,194 @@ static u_int32_t adjacent(free_header_t *ptr);
 // ** Complete ** 
 void vlad_init(u_int32_t size)
 {
-    if(memory!=NULL) return;
+    vlad_init_arenas(size, 1);
+}
+
+// Input: size - number of bytes in each arena
+//        n - number of arenas (0 = one per CPU core, at most MAX_ARENAS)
+// Output: none
+// Precondition: as for vlad_init
+// Postcondition: n arenas of `size` bytes are available; each thread is
+//                given a home arena by a hash of its thread id, and moves
+//                to the least contended arena when its home is often busy
+//
+// (If the allocator is already initialised, this function does nothing)
+
+void vlad_init_arenas(u_int32_t size, u_int32_t n)
+{
+    if(vlad_try_init_arenas(size, n) != 0){
+        fprintf(stderr, "vlad_init: Insufficient memory\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Input: size, n - as for vlad_init_arenas
+// Output: 0, or -1 if the memory could not be mapped
+// Postcondition: as for vlad_init_arenas; on failure nothing is left
+//                mapped and the allocator is not initialised
+//
+// For callers that have somewhere else to go when Vlad cannot start,
+// e.g. the LD_PRELOAD shim, which falls back to the next malloc.
+
+int vlad_try_init_arenas(u_int32_t size, u_int32_t n)
+{
+    if(arenas[0].start != NULL) return 0;
+
+    if(n == 0){
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        n = (cores > 0) ? cores : 1;
+    }
+    if(n > MAX_ARENAS){
+        n = MAX_ARENAS;
+    }
+    return initArenas(powerOfTwo(size), n, NULL) ? 0 : -1;
+}
+
+// Input: size - number of bytes in each arena
+// Output: none
+// Precondition: as for vlad_init
+// Postcondition: there is one arena of `size` bytes for each NUMA node,
+//                with its memory bound to that node; each thread allocates
+//                from the arena of the node it is running on
+//
+// Without NUMA (no node list in /sys) this is a single, unbound arena.
+// If mbind fails, the arena is still used, just without the binding.
 
-    size = powerOfTwo(size);
+void vlad_init_numa(u_int32_t size)
+{
+    if(arenas[0].start != NULL) return;
 
-    memory = malloc(size);
-    // if malloc fails, an error message is diplayed and the program will exit
-    if(memory==NULL){
+    int nodes[MAX_ARENAS];
+    u_int32_t n = onlineNodes(nodes, MAX_ARENAS);
+    if(n == 0){
+        vlad_init(size);
+        return;
+    }
+    if(!initArenas(powerOfTwo(size), n, nodes)){
         fprintf(stderr, "vlad_init: Insufficient memory\n");
         exit(EXIT_FAILURE);
     }
+}
+
+// Input: g - block granule, a power of two from 4 to 16
+// Output: 0, or -1 if g is out of range or the allocator is initialised
+// Postcondition: arenas set up from now on round every block to a
+//                multiple of g, and map MAP_LEAD bytes in front of
+//                memory[] so that all payloads are aligned to g
+//
+// The granule cannot change under a running heap: the blocks already
+// in it would not be multiples of the new one.
+
+int vlad_set_granule(u_int32_t g)
+{
+    if(g < 4 || g > 16 || (g & (g - 1)) != 0) return -1;
+    if(arenas[0].start != NULL) return -1;
+
+    granule = g;
+    return 0;
+}
+
+// Input: size - number of bytes in each arena (a power of two)
+//        n - number of arenas
+//        nodes - NUMA node for each arena (NULL = no binding)
+// Output: TRUE, or FALSE if an arena's memory could not be mapped (the
+//         arenas already set up are then unmapped again)
+
+static int initArenas(vsize_t size, u_int32_t n, const int *nodes)
+{
+    // set only here, while no other thread can be using Vlad: vlad_free
+    // and the purge thread read it without a lock
+    page_shift = __builtin_ctzl(sysconf(_SC_PAGESIZE));
+
+    u_int32_t i;
+    for(i = 0; i < n; i++){
+        arena = &arenas[i];
+        if(!initArena(size, (nodes != NULL) ? nodes[i] : -1)){
+            while(i-- > 0){
+                munmap(arenas[i].start - MAP_LEAD, arenas[i].mapped);
+                arenas[i].start = NULL;
+                pthread_mutex_destroy(&arenas[i].lock);
+            }
+            arena = &arenas[0];
+            return FALSE;
+        }
+    }
+    num_arenas = n;
+    arena = &arenas[0];
+    return TRUE;
+}
+
+// Input: size - number of bytes (a power of two)
+//        node - NUMA node to bind the memory to (-1 = no binding)
+// Output: TRUE, or FALSE if there was no memory (memory[] is then NULL)
+// Postcondition: the arena being worked on is an empty heap of size bytes
+
+static int initArena(vsize_t size, int node)
+{
+    // mmap'd memory is known to be zero, so vlad_calloc need not clear
+    // anything that has never been handed out (see dirty_end); it is
+    // mapped directly, rather than calloc'd, so that mbind can work on
+    // whole pages and so that Vlad can itself be the process's malloc
+    byte *mapped = mmap(NULL, size + MAP_LEAD, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mapped == MAP_FAILED){
+        memory = NULL;
+        return FALSE;
+    }
+    if(node >= 0){
+        unsigned long mask = 1UL << node;
+        syscall(SYS_mbind, mapped, (unsigned long) size + MAP_LEAD, MPOL_BIND,
+                &mask, 8 * sizeof(mask) + 1, 0);
+    }
+    memory = mapped + MAP_LEAD;
+    arena->mapped = size + MAP_LEAD;
+    arena->node = node;
     
     // set global variable values
     free_list_ptr = 0;
     memory_size = size;
     strategy = BEST_FIT;
+    arena->adaptive = FALSE;
+    arena->split_min = SPLIT_MIN;
+    arena->split_low = SPLIT_MIN;
+    arena->split_high = SPLIT_MIN;
+    arena->seed = 1927 + (arena - arenas);
+    arena->calm = 0;
+    arena->window_searches = 0;
+    arena->window_steps = 0;
+    arena->window_failures = 0;
+    arena->window_bytes = 0;
+    dirty_end = 0;
+    arena->dirty_top = size;
+    arena->victim = NO_BLOCK;
+    arena->victim_max = 0;
+    arena->permanent_floor = size;
+
+    // start in eager coalescing mode with an empty cache
+    int bin;
+    for(bin = 0; bin < CACHE_BINS; bin++){
+        cache_bin[bin] = NO_BLOCK;
+    }
+    cache_bytes = 0;
+    cache_budget = 0;
+    atomic_init(&remote_free_head, NO_BLOCK);
+    split_count = 0;
+    merge_count = 0;
+    cache_hits = 0;
+    arena->handles = NULL;
+    arena->handle_slots = 0;
+    arena->handle_hint = 0;
+    arena->index_sizes = NULL;
+    arena->index_offsets = NULL;
+    arena->index_table = NULL;
+    arena->index_count = 0;
+    arena->index_slots = 0;
+    arena->index_lost = 0;
+    arena->page_idle = NULL;
+    arena->pages = 0;
+    chooseBestFit();
+    pthread_mutex_init(&arena->lock, NULL);
+    atomic_init(&arena->contention, 0);
 
     // setup the initial region header
     free_header_t *regionHeader = makeRealPtr(free_list_ptr);
@@ -109,6 +605,7 @@ void vlad_init(u_int32_t size)
     // next and prev should point to the header itself
     regionHeader->next = 0;
     regionHeader->prev = 0;
+    return TRUE;
 }
 
 // Input: n - number of bytes requested
@@ -120,36 +617,269 @@ void vlad_init(u_int32_t size)
 //                      n + header size.
 
 void *vlad_malloc(u_int32_t n)
+{
+    if(wantHuge(n)){
+        void *object = hugeAlloc(HUGE_HEADER_SIZE, n);
+        if(object != NULL) return object;
+    }
+
+    void *object = allocate(n, NO_HINT, NULL);
+    profileAlloc(object, n);
+    return object;
+}
+
+// Input: n - number of bytes requested
+//        lifetime - VLAD_SHORT, VLAD_LONG or VLAD_PERMANENT (anything else
+//                   is no hint, as for vlad_malloc)
+// Output: as for vlad_malloc
+//
+// A long-lived block in the middle of short-lived ones keeps them from
+// merging when they are freed. Keeping each lifetime in its own end of
+// the arena lets the short-lived end empty out and coalesce (see
+// takeHinted). Hinted requests do not use the vlad_set_lazy cache, whose
+// blocks could be anywhere.
+
+void *vlad_malloc_hint(u_int32_t n, int lifetime)
+{
+    if(lifetime != VLAD_SHORT && lifetime != VLAD_LONG && lifetime != VLAD_PERMANENT){
+        lifetime = NO_HINT;
+    }
+    if(wantHuge(n)){
+        void *object = hugeAlloc(HUGE_HEADER_SIZE, n);
+        if(object != NULL) return object;
+    }
+
+    void *object = allocate(n, lifetime, NULL);
+    profileAlloc(object, n);
+    return object;
+}
+
+// Input: n - number of bytes requested
+//        lifetime - a hint as for vlad_malloc_hint, or NO_HINT
+//        clean - if not NULL, set to the part of the arena used that
+//                had never been handed out (clean[0] up to clean[1]),
+//                as it was before the block was taken
+// Output: as for vlad_malloc
+//
+// The thread's home arena is tried first; if it cannot satisfy the
+// request, each other arena is tried in turn. On return `arena` is the
+// arena the block came from.
+
+static void *allocate(u_int32_t n, int lifetime, vaddr_t *clean)
+{
+    if(num_arenas == 0) return NULL;
+
+    arena_t *home = lockHomeArena();
+    void *object = NULL;
+    u_int32_t i;
+    for(i = 0; i < num_arenas && object == NULL; i++){
+        arena_t *next = &arenas[(home - arenas + i) % num_arenas];
+        if(i > 0){
+            pthread_mutex_lock(&next->lock);
+            arena = next;
+        }
+        if(clean != NULL){
+            clean[0] = dirty_end;
+            clean[1] = arena->dirty_top;
+        }
+        object = arenaMalloc(n, lifetime);
+        pthread_mutex_unlock(&next->lock);
+    }
+    return object;
+}
+
+// Input: owner - an arena; n - number of bytes requested
+// Output: as for vlad_malloc, from owner only; `arena` is set to owner
+
+static void *allocateIn(arena_t *owner, u_int32_t n)
+{
+    pthread_mutex_lock(&owner->lock);
+    arena = owner;
+    void *object = arenaMalloc(n, NO_HINT);
+    pthread_mutex_unlock(&owner->lock);
+    return object;
+}
+
+// Input: n - number of bytes requested
+//        lifetime - a hint as for vlad_malloc_hint, or NO_HINT
+// Output: as for vlad_malloc, from the arena being worked on
+// Precondition: the caller holds that arena's lock
+
+static void *arenaMalloc(u_int32_t n, int lifetime)
+{
+    // no block holds more than MAX_REQUEST bytes
+    if(n > MAX_REQUEST){
+        return NULL;
+    }
+
+    // round up n (plus header) to the nearest multiple of four, or of
+    // the granule if that is larger
+    n = blockSize(n);
+
+    // take back blocks that other threads have freed
+    if(atomic_load_explicit(&remote_free_head, memory_order_relaxed) != NO_BLOCK){
+        drainRemoteFrees();
+    }
+
+    // in lazy mode, reuse a recently freed block of exactly this size
+    if(cache_budget > 0 && n <= CACHE_MAX_SIZE && lifetime == NO_HINT){
+        vaddr_t cached = cache_bin[(n - MIN_MEMORY) / 4];
+        if(cached != NO_BLOCK){
+            alloc_header_t *block = makeRealPtr(cached);
+            cache_bin[(n - MIN_MEMORY) / 4] = *cacheLink(block);
+            cache_bytes -= block->size;
+            cache_hits++;
+            block->magic = MAGIC_ALLOC;
+            return ((void*) block + ALLOC_HEADER_SIZE);
+        }
+    }
+
+    free_header_t *curr = (lifetime == NO_HINT) ? takeBlock(n) : takeHinted(n, lifetime);
+
+    // the free list may only be too fragmented because cached blocks
+    // have not been merged yet, so coalesce them and try once more
+    if(curr == NULL && cache_bytes > 0){
+        flushCache();
+        curr = (lifetime == NO_HINT) ? takeBlock(n) : takeHinted(n, lifetime);
+    }
+    if(curr == NULL){
+        return NULL;
+    }
+    markDirty(makeOffsetPtr(curr), makeOffsetPtr(curr) + curr->size);
+
+    return ((void*) curr + ALLOC_HEADER_SIZE);
+}
+
+// Input: nmemb, size - number and size of the elements requested
+// Output: p - a pointer to nmemb*size zero bytes, or NULL
+// Precondition: as for vlad_malloc(nmemb * size)
+// Postcondition: as for vlad_malloc, with the first nmemb*size bytes zero
+//
+// Nothing in memory[] between dirty_end and dirty_top has ever been handed
+// out, and merging wipes the header of the absorbed block, so the only
+// non-zero bytes there are the headers at the start of each block. Only
+// the parts of the new block below dirty_end and above dirty_top, plus
+// the tail of its old free header, are cleared.
+
+void *vlad_calloc(u_int32_t nmemb, u_int32_t size)
+{
+    if(size != 0 && nmemb > (u_int32_t) -1 / size){
+        return NULL;
+    }
+    u_int32_t n = nmemb * size;
+
+    // a new mapping is zero already
+    if(wantHuge(n)){
+        void *object = hugeAlloc(HUGE_HEADER_SIZE, n);
+        if(object != NULL) return object;
+    }
+
+    // past MAX_REQUEST, n has no block in memory[] to clear
+    if(n > MAX_REQUEST){
+        return NULL;
+    }
+
+    vaddr_t clean[2];
+    byte *object = allocate(n, NO_HINT, clean);
+    if(object == NULL){
+        return NULL;
+    }
+
+    vaddr_t start = makeOffsetPtr(object);
+    vsize_t clear = FREE_HEADER_SIZE - ALLOC_HEADER_SIZE;
+    if(clean[0] > start && clean[0] - start > clear){
+        clear = clean[0] - start;
+    }
+    if(clear > n){
+        clear = n;
+    }
+    memset(object, 0, clear);
+
+    // and whatever reaches up past dirty_top
+    vaddr_t top = (clean[1] > start + clear) ? clean[1] : start + clear;
+    if(top < start + n){
+        memset(object + (top - start), 0, start + n - top);
+    }
+
+    profileAlloc(object, n);
+    return object;
+}
+
+// Input: n - block size needed (including header, multiple of four)
+// Output: the header of a block of at least n bytes, now marked
+//         MAGIC_ALLOC and removed from the free list, or NULL
+//
+// With vlad_set_victim on, when a small request splits a block the
+// remainder becomes the arena's victim. Until the free list next gains a
+// block, each small request is carved from the front of the victim with
+// no search at all, so a burst of small allocations is laid out
+// contiguously.
+
+static free_header_t *takeBlock(vsize_t n)
 {
     int firstLoop = TRUE;
     int result = FALSE;
     int numCount=0;
+    u_int32_t fits = 0;
 
-    // round up n to the nearest multiple of four
-    // if already a multiple of four, it will just return n
-    n = multipleOfFour(n + ALLOC_HEADER_SIZE);
-
-    //printf("%d\n",n);
-    //printf("%d\n",memory_size);
-    
     free_header_t *curr = makeRealPtr(free_list_ptr);
     free_header_t *smallest = curr;
 
+    if(arena->adaptive && arena->window_searches >= ADAPT_WINDOW){
+        adaptPolicy();
+    }
+
+    if(n <= arena->victim_max && arena->victim != NO_BLOCK){
+        vaddr_t offset = arena->victim;
+        free_header_t *rest = makeRealPtr(offset);
+        checkHeader(rest);
+        if(rest->size >= THRESHOLD){
+            // the header moves up past the new block (and so does victim)
+            moveFreeHeader(offset, offset + n, rest->size - n, rest->next, rest->prev);
+            curr = makeRealPtr(offset);
+            curr->size = n;
+            curr->magic = MAGIC_ALLOC;
+            split_count++;
+            return curr;
+        }
+    }
+
+    // with an index, search its sizes[] rather than the headers
+    int entry = -1;
+    if(arena->index_sizes != NULL){
+        entry = indexFit(n);
+        if(entry >= 0){
+            smallest = makeRealPtr(arena->index_offsets[entry]);
+            checkHeader(smallest);
+            if(smallest->magic != MAGIC_FREE || smallest->size != arena->index_sizes[entry]){
+                fprintf(stderr, "vlad_malloc: Free-list index does not match the heap\n");
+                exit(EXIT_FAILURE);
+            }
+            result = TRUE;
+        }
+        numCount = arena->index_count;
+        firstLoop = FALSE;  // skip the walk below
+    }
+
     // transverse the free list 
-    // store the current smallest chunk of memory
-    // when a smaller chunk is found, replace it 
-    // finish the loop when back to the start (free_list_ptr)
+    // store the current best chunk of memory (by default the smallest)
+    // when a better chunk is found, replace it 
+    // finish the loop when back to the start (free_list_ptr), or at the
+    // first chunk that fits for FIRST_FIT
     while(curr != makeRealPtr(free_list_ptr) || firstLoop==TRUE){
         if(curr->size >= n){
+            fits++;
             if(firstLoop){
                 smallest = curr;
                 firstLoop=FALSE;
-            } else {
-                if(smallest->size > curr->size){
-                    smallest = curr;
-                }
-            } 
+            } else if(betterFit(curr->size, smallest->size, fits)){
+                smallest = curr;
+            }
             result=TRUE;
+            if(strategy == FIRST_FIT){
+                numCount++;
+                break;
+            }
         }
         curr = makeRealPtr(curr->next);
         if(curr == makeRealPtr(free_list_ptr)){
@@ -158,12 +888,16 @@ void *vlad_malloc(u_int32_t n)
         numCount++;
     }
     curr=smallest;
+    countSearch(n, numCount, result);
     
     // if there is no chunk of memory to fit n, return NULL immediately
     // result will be true if there is a chunk of memory to fit n
     if(result == FALSE){
         return NULL;
     }
+    if(makeOffsetPtr(curr) == arena->victim){
+        arena->victim = NO_BLOCK;
+    }
 
     // we have now found the smallest chunk of memory that can be used
     // we need to compare this to the threshold 
@@ -178,173 +912,2620 @@ void *vlad_malloc(u_int32_t n)
         freeHeader->prev = makeOffsetPtr(curr);
 
         curr->size = n;
+        split_count++;
+        if(entry >= 0){
+            indexSet(entry, makeOffsetPtr(freeHeader), freeHeader->size);
+        }
+        if(n <= arena->victim_max){
+            arena->victim = makeOffsetPtr(freeHeader);
+        }
 
         // connect freeHeader with the rest of the free list
         free_header_t *next = makeRealPtr(curr->next);
         next->prev = makeOffsetPtr(freeHeader);
         curr->next = makeOffsetPtr(freeHeader);
 
-    } else if(numCount == 1){
+    } else if(curr->next == makeOffsetPtr(curr)){
+        // the last free block is never handed out whole
         return NULL;
+    } else if(entry >= 0){
+        indexRemove(entry);
     }
 
     // covers both cases 
     // 1) smaller than threshold and enough free regions - simply remove curr
     // 2) larger than threshold and we need to remove curr from the free list
-    free_header_t *prev = makeRealPtr(curr->prev);
-    free_header_t *next = makeRealPtr(curr->next);
-    prev->next = curr->next;
-    next->prev = curr->prev;        
-    
-    // free list pointer update 
-    if(curr == makeRealPtr(free_list_ptr)){
-        free_list_ptr = curr->next;
-    }
+    unlinkFree(curr);
 
     // check the header to ensure no arbitrary numbers
     checkHeader(curr);
     curr->magic = MAGIC_ALLOC;  
 
-    return ((void*) curr + ALLOC_HEADER_SIZE);
+    return curr;
 }
 
-// Input: object, a pointer.
-// Output: none
-// Precondition: object points to a location immediately after a header block
-//               within the allocator's memory.
-// Postcondition: The region pointed to by object has been placed in the free
-//                list, and merged with any adjacent free blocks; the memory
-//                space can be re-allocated by vlad_malloc
+// Input: n - block size needed (including header, multiple of four)
+//        lifetime - VLAD_SHORT, VLAD_LONG or VLAD_PERMANENT
+// Output: as for takeBlock
+//
+// A short-lived block is cut from the front of the lowest free block that
+// fits, and a permanent one from the back of the highest, so the two
+// grow towards each other from either end of memory[]. A long-lived
+// block is cut from the back of the highest free block that ends below
+// every permanent block (if there is one that fits). The holes that
+// long-lived blocks leave are then next to each other rather than among
+// permanent blocks that will never be freed.
+//
+// With an index (vlad_set_index), its sizes[] and offsets[] are scanned
+// rather than the headers on the free list.
 
-void vlad_free(void *object)
+static free_header_t *takeHinted(vsize_t n, int lifetime)
 {
-    // make sure that the region is valid
-    // print an error message and return if not a valid region
-    // otherwise, make the allocated region header into a free header
-
-    free_header_t *freePtr = (free_header_t*) ((void*) object - ALLOC_HEADER_SIZE);
-    int objectPos = makeOffsetPtr(object);
+    vaddr_t offset = NO_BLOCK;
+    u_int64_t rank = 0;
 
-    if(objectPos < 0 || objectPos > memory_size){
-        fprintf(stderr, "vlad_free: Attempt to free via invalid pointer\n");
-        exit(EXIT_FAILURE);
+    if(arena->index_sizes != NULL){
+        int entry = -1;
+        u_int32_t i;
+        for(i = 0; i < arena->index_count; i++){
+            if(arena->index_sizes[i] >= n){
+                u_int64_t r = hintedRank(arena->index_offsets[i], arena->index_sizes[i], lifetime);
+                if(entry < 0 || r > rank){
+                    entry = i;
+                    rank = r;
+                }
+            }
+        }
+        if(entry < 0) return NULL;
+        offset = arena->index_offsets[entry];
+        free_header_t *block = makeRealPtr(offset);
+        checkHeader(block);
+        if(block->magic != MAGIC_FREE || block->size != arena->index_sizes[entry]){
+            fprintf(stderr, "vlad_malloc: Free-list index does not match the heap\n");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        vaddr_t curr = free_list_ptr;
+        do{
+            free_header_t *block = makeRealPtr(curr);
+            if(block->size >= n){
+                u_int64_t r = hintedRank(curr, block->size, lifetime);
+                if(offset == NO_BLOCK || r > rank){
+                    offset = curr;
+                    rank = r;
+                }
+            }
+            curr = block->next;
+        } while(curr != free_list_ptr);
+        if(offset == NO_BLOCK) return NULL;
     }
 
-    if(freePtr->magic != MAGIC_ALLOC){
-        fprintf(stderr, "vlad_free: Attempt to free non-allocated memory\n");
-        exit(EXIT_FAILURE);
+    free_header_t *chosen = makeRealPtr(offset);
+    checkHeader(chosen);
+
+    free_header_t *curr = chosen;
+    if(chosen->size < THRESHOLD){
+        // too small to split: take all of it, unless it is the last one
+        if(chosen->next == offset) return NULL;
+        unlinkFree(chosen);
+        indexDrop(offset);
+        if(arena->victim == offset){
+            arena->victim = NO_BLOCK;
+        }
+    } else if(lifetime == VLAD_SHORT){
+        moveFreeHeader(offset, offset + n, chosen->size - n, chosen->next, chosen->prev);
+        chosen->size = n;
+        split_count++;
     } else {
-        checkHeader(freePtr);
-        freePtr->magic = MAGIC_FREE;
+        // the free block keeps its header and just gets shorter
+        chosen->size -= n;
+        indexMove(offset, offset, chosen->size);
+        curr = makeRealPtr(offset + chosen->size);
+        curr->size = n;
+        split_count++;
     }
 
-    int firstLoop = TRUE;
-    free_header_t *curr = makeRealPtr(free_list_ptr);
+    if(lifetime == VLAD_PERMANENT && makeOffsetPtr(curr) < arena->permanent_floor){
+        arena->permanent_floor = makeOffsetPtr(curr);
+    }
+    curr->magic = MAGIC_ALLOC;
+    return curr;
+}
 
-    while(curr != makeRealPtr(free_list_ptr) || firstLoop == TRUE){
-        if(freePtr->size >= curr->size){
-            if(curr->next == free_list_ptr){
-                curr = makeRealPtr(curr->next);
-                break;
-            }
-            curr = makeRealPtr(curr->next);
-        } else {
-            break;
-        }
+// Input: offset, size - a free block that a hinted request fits in
+//        lifetime - as for takeHinted
+// Output: how good a place it is for the request (the higher the better)
+
+static u_int64_t hintedRank(vaddr_t offset, vsize_t size, int lifetime)
+{
+    if(lifetime == VLAD_SHORT){
+        return (u_int32_t) ~offset;
     }
+    u_int64_t below = (lifetime == VLAD_LONG
+                       && offset + size <= arena->permanent_floor);
+    return (below << 32) | offset;
+}
 
-    // update free_list_ptr to point to first free region
-    free_header_t *temp = makeRealPtr(free_list_ptr);
-    if(freePtr->size < temp->size){
-        free_list_ptr = makeOffsetPtr(freePtr);
-    } 
+// Input: block - a block on the free list
+// Postcondition: block is no longer on the free list
 
-    free_header_t *prev = makeRealPtr(curr->prev);
-    prev->next = makeOffsetPtr(freePtr);
-    freePtr->prev = makeOffsetPtr(prev);
+static void unlinkFree(free_header_t *block)
+{
+    free_header_t *prev = makeRealPtr(block->prev);
+    free_header_t *next = makeRealPtr(block->next);
+    prev->next = block->next;
+    next->prev = block->prev;
 
-    curr->prev = makeOffsetPtr(freePtr);
-    freePtr->next = makeOffsetPtr(curr);
-    
-    vlad_merge();
+    // free list pointer update
+    if(block == makeRealPtr(free_list_ptr)){
+        free_list_ptr = block->next;
+    }
 }
 
-// Input: current state of the memory[]
-// Output: new state, where any adjacent blocks in the free list
-//            have been combined into a single larger block; after this,
-//            there should be no region in the free list whose next
-//            reference is to a location just past the end of the region
+// Input: object - any pointer
+// Output: TRUE if object points into one of Vlad's arenas, or is a huge
+//         block, else FALSE
 
-static void vlad_merge()
+int vlad_owns(void *object)
 {
-    free_header_t *curr = makeRealPtr(free_list_ptr);
-    int firstLoop = TRUE;
-    int i = 0;
+    if(findArena(object) != NULL) return TRUE;
 
-    while(i < 2){
+    pthread_mutex_lock(&huge_lock);
+    int huge = findHuge(object) != NULL;
+    pthread_mutex_unlock(&huge_lock);
+    return huge;
+}
 
-        firstLoop = TRUE;
-        curr = makeRealPtr(free_list_ptr);
-        while(curr != makeRealPtr(free_list_ptr) || firstLoop == TRUE){
+// Input: object, a pointer returned by vlad_malloc (or NULL)
+// Output: the number of bytes the caller may use at object
+//
+// This can be more than was asked for: requests are rounded up by
+// blockSize, and a whole free block is handed out when splitting it
+// would leave a remainder below THRESHOLD.
+
+u_int32_t vlad_usable_size(void *object)
+{
+    if(object == NULL) return 0;
+
+    alloc_header_t *block = (alloc_header_t *) ((void*) object - ALLOC_HEADER_SIZE);
+    if(block->magic == MAGIC_MMAP){
+        huge_header_t *header = (huge_header_t *) ((byte *) object - HUGE_HEADER_SIZE);
+        return header->length - ((byte *) object - hugeBase(header));
+    }
+    if(block->magic != MAGIC_ALLOC) return 0;
+
+    return block->size - ALLOC_HEADER_SIZE;
+}
+
+// Input: n - number of bytes a caller intends to request
+// Output: the usable size vlad_malloc(n) will give at least, so callers
+//         can size their capacity to fill the block, or 0 if n is past
+//         MAX_REQUEST, which no block can hold
+// (vlad_malloc may still hand out a larger block; see vlad_usable_size)
+
+u_int32_t vlad_good_size(u_int32_t n)
+{
+    if(n > MAX_REQUEST){
+        return 0;
+    }
+    return blockSize(n) - ALLOC_HEADER_SIZE;
+}
+
+// Input: object - a pointer returned by vlad_malloc (or NULL)
+//        n - number of bytes now needed
+// Output: p - a pointer to a block of at least n bytes holding the
+//         old contents (up to n bytes), or NULL if there is no room,
+//         in which case object is unchanged
+// Postcondition: if p != object, object has been freed, and p is aligned
+//                to REALLOC_ALIGN bytes if object was;
+//                vlad_realloc(NULL, n) is vlad_malloc(n), and
+//                vlad_realloc(object, 0) frees object and returns NULL
+//
+// A block is grown in place when the block after it is free and big
+// enough, so nothing needs to be copied.
+
+void *vlad_realloc(void *object, u_int32_t n)
+{
+    if(object == NULL) return vlad_malloc(n);
+    if(n == 0){
+        vlad_free(object);
+        return NULL;
+    }
+
+    arena_t *owner = findArena(object);
+    if(owner == NULL){
+        void *moved;
+        if(reallocHuge(object, n, &moved)) return moved;
+        fprintf(stderr, "vlad_realloc: Attempt to resize via invalid pointer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    alloc_header_t *block = (alloc_header_t *) ((byte *) object - ALLOC_HEADER_SIZE);
+    if(block->magic != MAGIC_ALLOC){
+        fprintf(stderr, "vlad_realloc: Attempt to resize non-allocated memory\n");
+        exit(EXIT_FAILURE);
+    }
+    vsize_t oldSize = block->size - ALLOC_HEADER_SIZE;
+    if(n <= oldSize) return object;
+
+    pthread_mutex_lock(&owner->lock);
+    arena = owner;
+    int grown = n <= MAX_REQUEST
+                && growInPlace(block, blockSize(n));
+    pthread_mutex_unlock(&owner->lock);
+    if(grown) return object;
+
+    // a block that was aligned like malloc's stays aligned when it moves
+    void *moved = ((uintptr_t) object % REALLOC_ALIGN == 0)
+                  ? vlad_aligned_alloc(REALLOC_ALIGN, n) : vlad_malloc(n);
+    if(moved == NULL) return NULL;
+    memcpy(moved, object, oldSize);
+    vlad_free(object);
+    return moved;
+}
+
+// Input: block - header of an allocated block in the arena being worked on
+//        n - block size needed (including header, multiple of four)
+// Output: TRUE if the block now has at least n bytes, FALSE if unchanged
+// Precondition: the caller holds the arena's lock
+//
+// The free block just after `block` gives up its first bytes: its header
+// moves up past the new end of `block` and keeps its place in the free
+// list. If what would be left is too small to be a block, all of it is
+// taken (unless it is the only free block, which is never handed out).
+
+static int growInPlace(alloc_header_t *block, vsize_t n)
+{
+    vaddr_t offset = makeOffsetPtr(block);
+    vaddr_t nextOffset = offset + block->size;
+    if(nextOffset >= memory_size) return FALSE;
+
+    free_header_t *next = makeRealPtr(nextOffset);
+    if(next->magic != MAGIC_FREE || block->size + next->size < n) return FALSE;
+
+    vsize_t total = block->size + next->size;
+    if(total - n >= 2*FREE_HEADER_SIZE){
+        moveFreeHeader(nextOffset, offset + n, total - n, next->next, next->prev);
+        block->size = n;
+    } else {
+        if(next->next == nextOffset) return FALSE;
+
+        free_header_t *prev = makeRealPtr(next->prev);
+        free_header_t *after = makeRealPtr(next->next);
+        prev->next = next->next;
+        after->prev = next->prev;
+        if(free_list_ptr == nextOffset){
+            free_list_ptr = next->next;
+        }
+        indexDrop(nextOffset);
+        if(arena->victim == nextOffset){
+            arena->victim = NO_BLOCK;
+        }
+        block->size = total;
+    }
+
+    markDirty(offset, offset + block->size);
+    return TRUE;
+}
+
+// Input: start, end - bytes of memory[] just handed out
+// Postcondition: no byte from start up to end is between dirty_end and
+//                dirty_top, which have never been handed out
+//
+// Most blocks come from the low end and just push dirty_end up. A block
+// cut from the back of a free block (VLAD_LONG and VLAD_PERMANENT hints)
+// brings dirty_top down instead, so that one long-lived block at the top
+// of memory[] does not make all of it dirty. A block inside the clean gap
+// keeps whichever side of it is larger clean.
+
+static void markDirty(vaddr_t start, vaddr_t end)
+{
+    if(end <= dirty_end || start >= arena->dirty_top) return;
+
+    vsize_t above = (end < arena->dirty_top) ? arena->dirty_top - end : 0;
+    vsize_t below = (start > dirty_end) ? start - dirty_end : 0;
+    if(below > above){
+        arena->dirty_top = start;
+    } else {
+        dirty_end = end;
+        if(arena->dirty_top < end){
+            arena->dirty_top = end;
+        }
+    }
+}
+
+// Input: alignment - a power of two; n - number of bytes requested
+// Output: p - a pointer that is a multiple of alignment, or NULL
+// Precondition: as for vlad_malloc
+// Postcondition: as for vlad_malloc
+//
+// Enough is allocated that an aligned address can be found with either
+// no bytes or at least MIN_MEMORY bytes before it; those bytes are split
+// off as a block of their own and freed.
+
+void *vlad_aligned_alloc(u_int32_t alignment, u_int32_t n)
+{
+    return alignedAlloc(NULL, alignment, n);
+}
+
+// Input: index - which arena (0 to the number of arenas - 1)
+//        alignment, n - as for vlad_aligned_alloc
+// Output: as for vlad_aligned_alloc, but only from arenas[index]; NULL if
+//         that arena has no room (or there is no such arena)
+//
+// Lets a caller keep related objects together, e.g. one container per
+// arena; they are freed as usual, with vlad_free or vlad_free_sized.
+
+void *vlad_arena_alloc(u_int32_t index, u_int32_t alignment, u_int32_t n)
+{
+    if(index >= num_arenas) return NULL;
+    return alignedAlloc(&arenas[index], alignment, n);
+}
+
+// Input: only - the arena to allocate from (NULL = any, home arena first)
+//        alignment, n - as for vlad_aligned_alloc
+// Output: as for vlad_aligned_alloc
+
+static void *alignedAlloc(arena_t *only, u_int32_t alignment, u_int32_t n)
+{
+    if(alignment == 0 || (alignment & (alignment - 1)) != 0) return NULL;
+    if(n > (u_int32_t) -1 - alignment - MIN_MEMORY - 4 - ALLOC_HEADER_SIZE){
+        return NULL;
+    }
+    if(only == NULL && wantHuge(n)){
+        void *object = hugeAlloc(alignment, n);
+        if(object != NULL) return object;
+    }
+
+    // every block is aligned to the granule already; otherwise the lead
+    // block can take up to alignment - 4 + MIN_MEMORY bytes, and what is
+    // left must still be a whole block (at least MIN_MEMORY)
+    u_int32_t size = n;
+    if(alignment > granule){
+        size = (n < MIN_MEMORY - ALLOC_HEADER_SIZE)
+               ? MIN_MEMORY - ALLOC_HEADER_SIZE : n;
+        size += alignment + MIN_MEMORY;
+    }
+    byte *object = (only == NULL) ? allocate(size, NO_HINT, NULL) : allocateIn(only, size);
+    if(object == NULL) return NULL;
+
+    uintptr_t address = (uintptr_t) object;
+    uintptr_t aligned = (address + alignment - 1) & ~(uintptr_t) (alignment - 1);
+    while(aligned != address && aligned - address < MIN_MEMORY){
+        aligned += alignment;
+    }
+    if(aligned == address){
+        profileAlloc(object, n);
+        return object;
+    }
+
+    arena_t *owner = arena;
+    pthread_mutex_lock(&owner->lock);
+    arena = owner;
+
+    alloc_header_t *lead = (alloc_header_t *) (object - ALLOC_HEADER_SIZE);
+    alloc_header_t *block = (alloc_header_t *) ((byte *) aligned - ALLOC_HEADER_SIZE);
+    block->magic = MAGIC_ALLOC;
+    block->size = lead->size - (aligned - address);
+    lead->size = aligned - address;
+    arenaFree(object);
+
+    pthread_mutex_unlock(&owner->lock);
+    profileAlloc((void *) aligned, n);
+    return (void *) aligned;
+}
+
+// Input: object, a pointer.
+// Output: none
+// Precondition: object points to a location immediately after a header block
+//               within the allocator's memory.
+// Postcondition: The region pointed to by object has been placed in the free
+//                list, and merged with any adjacent free blocks; the memory
+//                space can be re-allocated by vlad_malloc
+
+void vlad_free(void *object)
+{
+    arena_t *owner = findArena(object);
+    if(owner == NULL){
+        if(freeHuge(object)) return;
+        fprintf(stderr, "vlad_free: Attempt to free via invalid pointer\n");
+        exit(EXIT_FAILURE);
+    }
+    profileFree(object);
+
+    pthread_mutex_lock(&owner->lock);
+    arena = owner;
+    arenaFree(object);
+    pthread_mutex_unlock(&owner->lock);
+}
+
+// Input: object, a pointer
+// Output: as for vlad_free, in the arena being worked on
+// Precondition: the caller holds that arena's lock
+
+static void arenaFree(void *object)
+{
+    // make sure that the region is valid
+    // print an error message and return if not a valid region
+    // otherwise, make the allocated region header into a free header
+
+    free_header_t *freePtr = (free_header_t*) ((void*) object - ALLOC_HEADER_SIZE);
+    int objectPos = makeOffsetPtr(object);
+
+    if(objectPos < 0 || objectPos > memory_size){
+        fprintf(stderr, "vlad_free: Attempt to free via invalid pointer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(freePtr->magic != MAGIC_ALLOC){
+        fprintf(stderr, "vlad_free: Attempt to free non-allocated memory\n");
+        exit(EXIT_FAILURE);
+    } else {
+        checkHeader(freePtr);
+    }
+
+    // in lazy mode, park small blocks in the cache instead of merging
+    // once the cache would go over budget, merge everything it holds first
+    if(freePtr->size <= cache_budget && freePtr->size <= CACHE_MAX_SIZE){
+        cacheBlock((alloc_header_t *) freePtr);
+        return;
+    }
+
+    releaseBlock(freePtr);
+}
+
+// Input: object, a pointer; n, the number of bytes it was allocated with
+// Output: none
+// Precondition: object was returned by vlad_malloc(n)
+// Postcondition: as for vlad_free(object)
+//
+// In lazy mode, a small block whose size is known goes straight into its
+// cache bin, with no list search or merge. In eager mode this does the
+// same as vlad_free. The header is checked as vlad_free checks it, and
+// n against the size it records.
+
+void vlad_free_sized(void *object, u_int32_t n)
+{
+    arena_t *owner = findArena(object);
+    if(owner == NULL){
+        if(freeHuge(object)) return;
+        fprintf(stderr, "vlad_free_sized: Attempt to free via invalid pointer\n");
+        exit(EXIT_FAILURE);
+    }
+    profileFree(object);
+
+    pthread_mutex_lock(&owner->lock);
+    arena = owner;
+
+    alloc_header_t *block = (alloc_header_t *) ((void*) object - ALLOC_HEADER_SIZE);
+    vsize_t size = blockSize(n);
+
+    if(block->magic != MAGIC_ALLOC){
+        fprintf(stderr, "vlad_free_sized: Attempt to free non-allocated memory\n");
+        exit(EXIT_FAILURE);
+    }
+    checkHeader(block);
+
+    // the block may be bigger than n asked for (the whole of a free block
+    // is handed out when splitting would leave too small a remainder)
+    if(block->size < size){
+        fprintf(stderr, "vlad_free_sized: Size does not match allocated block\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(size <= cache_budget && size <= CACHE_MAX_SIZE
+       && block->size == size){
+        cacheBlock(block);
+    } else {
+        releaseBlock((free_header_t *) block);
+    }
+    pthread_mutex_unlock(&owner->lock);
+}
+
+// Input: object, a pointer returned by vlad_malloc
+// Output: none
+// Precondition: as for vlad_free; may be called from any thread
+// Postcondition: the block is queued for release, and is returned to the
+//                free list (or cache) by the next vlad_malloc
+//
+// Instead of taking the lock of the arena that owns the block, the block is
+// pushed onto that arena's remote_free_head with a single compare-and-swap,
+// so the caller never waits for the thread working on the arena.
+
+void vlad_free_remote(void *object)
+{
+    arena_t *owner = findArena(object);
+    if(owner == NULL){
+        if(freeHuge(object)) return;
+        fprintf(stderr, "vlad_free_remote: Attempt to free via invalid pointer\n");
+        exit(EXIT_FAILURE);
+    }
+    arena = owner;
+
+    alloc_header_t *block = (alloc_header_t *) ((void*) object - ALLOC_HEADER_SIZE);
+    vaddr_t offset = makeOffsetPtr(block);
+
+    if(offset > memory_size - MIN_MEMORY){
+        fprintf(stderr, "vlad_free_remote: Attempt to free via invalid pointer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // claim the block: of two frees of it racing here (or one after the
+    // other), only one sees MAGIC_ALLOC. To the owner, which may be
+    // reading this header to see if it can merge a neighbour, a queued
+    // block is as much "not free" as an allocated one
+    u_int32_t expected = MAGIC_ALLOC;
+    if(!__atomic_compare_exchange_n(&block->magic, &expected, MAGIC_QUEUED, FALSE,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+        fprintf(stderr, "vlad_free_remote: Attempt to free non-allocated memory\n");
+        exit(EXIT_FAILURE);
+    }
+    profileFree(object);
+
+    vaddr_t head = atomic_load_explicit(&remote_free_head, memory_order_relaxed);
+    do{
+        *cacheLink(block) = head;
+    } while(!atomic_compare_exchange_weak_explicit(&remote_free_head, &head, offset,
+                                                   memory_order_release,
+                                                   memory_order_relaxed));
+}
+
+// Postcondition: every block pushed by vlad_free_remote so far has been
+//                released as if by vlad_free
+//
+// The whole stack is taken with one exchange, so pushes that race with
+// the drain simply start a new stack (no ABA problem).
+
+static void drainRemoteFrees(void)
+{
+    vaddr_t curr = atomic_exchange_explicit(&remote_free_head, NO_BLOCK,
+                                            memory_order_acquire);
+    while(curr != NO_BLOCK){
+        alloc_header_t *block = makeRealPtr(curr);
+        curr = *cacheLink(block);
+
+        if(block->size <= cache_budget && block->size <= CACHE_MAX_SIZE){
+            cacheBlock(block);
+        } else {
+            releaseBlock((free_header_t *) block);
+        }
+    }
+}
+
+// Input: block - header of an allocated block of at most CACHE_MAX_SIZE
+// Postcondition: block is marked MAGIC_CACHED and held in its size's bin;
+//                if it would take the cache over budget, everything that
+//                was cached has been merged first
+
+static void cacheBlock(alloc_header_t *block)
+{
+    if(cache_bytes + block->size > cache_budget){
+        flushCache();
+    }
+    vaddr_t *bin = &cache_bin[(block->size - MIN_MEMORY) / 4];
+    block->magic = MAGIC_CACHED;
+    *cacheLink(block) = *bin;
+    *bin = makeOffsetPtr(block);
+    cache_bytes += block->size;
+}
+
+// Input: freePtr - header of an allocated or cached block
+// Output: none
+// Postcondition: the block is in the free list, merged with any
+//                adjacent free blocks
+
+static void releaseBlock(free_header_t *freePtr)
+{
+    freePtr->magic = MAGIC_FREE;
+
+    // a burst of small requests has ended; the next one searches again
+    arena->victim = NO_BLOCK;
+
+    int firstLoop = TRUE;
+    free_header_t *curr = makeRealPtr(free_list_ptr);
+
+    while(curr != makeRealPtr(free_list_ptr) || firstLoop == TRUE){
+        if(freePtr->size >= curr->size){
+            if(curr->next == free_list_ptr){
+                curr = makeRealPtr(curr->next);
+                break;
+            }
+            curr = makeRealPtr(curr->next);
+        } else {
+            break;
+        }
+    }
+
+    // update free_list_ptr to point to first free region
+    free_header_t *temp = makeRealPtr(free_list_ptr);
+    if(freePtr->size < temp->size){
+        free_list_ptr = makeOffsetPtr(freePtr);
+    } 
+
+    free_header_t *prev = makeRealPtr(curr->prev);
+    prev->next = makeOffsetPtr(freePtr);
+    freePtr->prev = makeOffsetPtr(prev);
+
+    curr->prev = makeOffsetPtr(freePtr);
+    freePtr->next = makeOffsetPtr(curr);
+    indexAdd(makeOffsetPtr(freePtr), freePtr->size);
+    idlePages(makeOffsetPtr(freePtr), freePtr->size);
+    
+    vlad_merge();
+}
+
+// Postcondition: every block held in cache_bin[] has been returned to the
+//                free list and merged; the cache is empty
+
+static void flushCache(void)
+{
+    int bin;
+    for(bin = 0; bin < CACHE_BINS; bin++){
+        while(cache_bin[bin] != NO_BLOCK){
+            free_header_t *block = makeRealPtr(cache_bin[bin]);
+            cache_bin[bin] = *cacheLink(block);
+            releaseBlock(block);
+        }
+    }
+    cache_bytes = 0;
+}
+
+// Input: policy - VLAD_BEST_FIT, VLAD_WORST_FIT, VLAD_RANDOM_FIT,
+//                 VLAD_FIRST_FIT or VLAD_ADAPTIVE
+//        split - smallest remainder a split may leave (at least MIN_MEMORY)
+//        split_max - with VLAD_ADAPTIVE, the largest it may become
+// Output: 0, or -1 if the arguments are not valid (nothing is changed)
+// Precondition: allocator has been vlad_init()'d
+// Postcondition: each arena places blocks by the policy; an adaptive
+//                arena starts at best fit with split_min = split
+
+int vlad_set_policy(int policy, u_int32_t split, u_int32_t split_max)
+{
+    if(policy < VLAD_BEST_FIT || policy > VLAD_ADAPTIVE) return -1;
+    if(split < MIN_MEMORY) return -1;
+    split = multipleOfFour(split);
+    if(policy != VLAD_ADAPTIVE){
+        split_max = split;
+    } else if(split_max < split){
+        return -1;
+    }
+
+    u_int32_t i;
+    for(i = 0; i < num_arenas; i++){
+        pthread_mutex_lock(&arenas[i].lock);
+        arena = &arenas[i];
+        arena->adaptive = (policy == VLAD_ADAPTIVE);
+        strategy = arena->adaptive ? BEST_FIT : policy;
+        arena->split_min = split;
+        arena->split_low = split;
+        arena->split_high = multipleOfFour(split_max);
+        arena->calm = 0;
+        arena->window_searches = 0;
+        arena->window_steps = 0;
+        arena->window_failures = 0;
+        arena->window_bytes = 0;
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    return 0;
+}
+
+// Input: max - largest request to carve from the last remainder, or 0 to
+//        always search the free list
+// Precondition: allocator has been vlad_init()'d
+// Postcondition: a run of vlad_mallocs of up to max bytes with no free in
+//                between takes consecutive blocks, each carved from what
+//                the previous one left, without searching the free list.
+//                This is dlmalloc's "last remainder": it gives up best fit
+//                for those requests in return for speed and locality.
+
+void vlad_set_victim(u_int32_t max)
+{
+    u_int32_t i;
+    for(i = 0; i < num_arenas; i++){
+        pthread_mutex_lock(&arenas[i].lock);
+        arenas[i].victim_max = (max > 0) ? blockSize(max) : 0;
+        arenas[i].victim = NO_BLOCK;
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+}
+
+// Input: on - TRUE to keep an index of the free list, FALSE to drop it
+// Output: 0, or -1 if there was no memory for the index (it is then off)
+// Postcondition: while the index is on, vlad_malloc's best-fit search
+//                reads two dense arrays instead of walking the free list
+//
+// The free list lives in the free blocks, so walking it touches a cache
+// line (or page) per block all over memory[]. The index keeps the size
+// and memory[] index of each free block side by side, in no particular
+// order; the headers are still kept up to date, and the block chosen is
+// checked against its header. A hash table from memory[] index to entry
+// lets merges and splits find a block's entry without a scan.
+//
+// If the index cannot grow later on, it is dropped; vlad_check counts
+// that in index_lost.
+
+int vlad_set_index(int on)
+{
+    int result = 0;
+    u_int32_t i;
+    for(i = 0; i < num_arenas; i++){
+        pthread_mutex_lock(&arenas[i].lock);
+        arena = &arenas[i];
+        dropIndex();
+        arena->index_lost = 0;
+        if(on && !buildIndex()){
+            result = -1;
+        }
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    return result;
+}
+
+// Output: TRUE, or FALSE if there was no memory (there is then no index)
+// Postcondition: the arena being worked on has an index of its free list
+
+static int buildIndex(void)
+{
+    if(!growIndex()) return FALSE;
+
+    vaddr_t curr = free_list_ptr;
+    do{
+        free_header_t *block = makeRealPtr(curr);
+        indexAdd(curr, block->size);
+        curr = block->next;
+    } while(curr != free_list_ptr);
+    return arena->index_sizes != NULL;
+}
+
+// Postcondition: the arena being worked on has no index
+
+static void dropIndex(void)
+{
+    if(arena->index_sizes != NULL){
+        munmap(arena->index_sizes, INDEX_BYTES(arena->index_slots));
+    }
+    arena->index_sizes = NULL;
+    arena->index_offsets = NULL;
+    arena->index_table = NULL;
+    arena->index_count = 0;
+    arena->index_slots = 0;
+}
+
+// Output: TRUE, or FALSE if there was no memory (there is then no index,
+//         and if there was one, index_lost has been counted up)
+// Postcondition: the index has room for twice as many blocks (or for
+//                INDEX_SLOTS, if there was none)
+//
+// All three arrays share one mapping: index_slots sizes, then as many
+// offsets, then the hash table (twice as many entries, so that it is at
+// most half full), which is built again from the offsets.
+
+static int growIndex(void)
+{
+    u_int32_t slots = (arena->index_slots > 0) ? 2 * arena->index_slots : INDEX_SLOTS;
+    vsize_t *sizes = mmap(NULL, INDEX_BYTES(slots), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(sizes == MAP_FAILED){
+        if(arena->index_sizes != NULL){
+            arena->index_lost++;
+        }
+        dropIndex();
+        return FALSE;
+    }
+    vaddr_t *offsets = (vaddr_t *) (sizes + slots);
+
+    u_int32_t count = arena->index_count;
+    if(count > 0){
+        memcpy(sizes, arena->index_sizes, count * sizeof(vsize_t));
+        memcpy(offsets, arena->index_offsets, count * sizeof(vaddr_t));
+    }
+    dropIndex();
+    arena->index_sizes = sizes;
+    arena->index_offsets = offsets;
+    arena->index_table = (u_int32_t *) (offsets + slots);
+    arena->index_count = count;
+    arena->index_slots = slots;
+
+    u_int32_t i;
+    for(i = 0; i < count; i++){
+        indexLink(i);
+    }
+    return TRUE;
+}
+
+// Input: offset, size - a block that has just become free
+// Postcondition: if there is an index, the block is in it
+
+static void indexAdd(vaddr_t offset, vsize_t size)
+{
+    if(arena->index_sizes == NULL) return;
+    if(arena->index_count == arena->index_slots && !growIndex()) return;
+
+    arena->index_sizes[arena->index_count] = size;
+    arena->index_offsets[arena->index_count] = offset;
+    indexLink(arena->index_count);
+    arena->index_count++;
+}
+
+// Input: from - a free block in the index
+//        to, size - where that block now starts, and its size
+// Postcondition: if there is an index, it has the block's new place/size
+
+static void indexMove(vaddr_t from, vaddr_t to, vsize_t size)
+{
+    int i = indexFind(from);
+    if(i < 0) return;
+    indexSet(i, to, size);
+}
+
+// Input: offset - a block that is no longer free
+// Postcondition: if there is an index, the block is not in it
+
+static void indexDrop(vaddr_t offset)
+{
+    int i = indexFind(offset);
+    if(i < 0) return;
+    indexRemove(i);
+}
+
+// Input: i - an entry in the index
+// Postcondition: the last entry has taken its place
+
+static void indexRemove(u_int32_t i)
+{
+    u_int32_t last = arena->index_count - 1;
+    indexUnlink(i);
+    if(i != last){
+        // same offset, so the same place in the table: just repoint it
+        arena->index_table[indexSlot(arena->index_offsets[last])] = i + 1;
+        arena->index_sizes[i] = arena->index_sizes[last];
+        arena->index_offsets[i] = arena->index_offsets[last];
+    }
+    arena->index_count--;
+}
+
+// Input: i - an entry in the index
+//        offset, size - the block it is now for
+// Postcondition: the entry (and its place in the hash table) is updated
+
+static void indexSet(u_int32_t i, vaddr_t offset, vsize_t size)
+{
+    indexUnlink(i);
+    arena->index_offsets[i] = offset;
+    arena->index_sizes[i] = size;
+    indexLink(i);
+}
+
+// Output: the entry for the free block at offset, or -1 if it is not in
+//         the index (or there is no index)
+
+static int indexFind(vaddr_t offset)
+{
+    if(arena->index_sizes == NULL) return -1;
+
+    u_int32_t mask = 2 * arena->index_slots - 1;
+    u_int32_t slot = indexHash(offset) & mask;
+    while(arena->index_table[slot] != 0){
+        u_int32_t i = arena->index_table[slot] - 1;
+        if(arena->index_offsets[i] == offset) return i;
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+// Input: offset - of a block whose entry is in the hash table
+// Output: where in the table that entry is
+
+static u_int32_t indexSlot(vaddr_t offset)
+{
+    u_int32_t mask = 2 * arena->index_slots - 1;
+    u_int32_t slot = indexHash(offset) & mask;
+    while(arena->index_offsets[arena->index_table[slot] - 1] != offset){
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static u_int32_t indexHash(vaddr_t offset)
+{
+    return (offset >> 2) * 2654435761u;
+}
+
+// Input: i - an entry not yet in the hash table
+// Postcondition: it is, under index_offsets[i]
+
+static void indexLink(u_int32_t i)
+{
+    u_int32_t mask = 2 * arena->index_slots - 1;
+    u_int32_t slot = indexHash(arena->index_offsets[i]) & mask;
+    while(arena->index_table[slot] != 0){
+        slot = (slot + 1) & mask;
+    }
+    arena->index_table[slot] = i + 1;
+}
+
+// Input: i - an entry in the hash table
+// Postcondition: it is not, and the entries after it that would no longer
+//                be found by a linear probe have moved back (as in
+//                dropSample)
+
+static void indexUnlink(u_int32_t i)
+{
+    u_int32_t mask = 2 * arena->index_slots - 1;
+    u_int32_t *table = arena->index_table;
+    u_int32_t slot = indexSlot(arena->index_offsets[i]);
+    u_int32_t next = slot;
+    for(;;){
+        table[slot] = 0;
+        u_int32_t home;
+        do{
+            next = (next + 1) & mask;
+            if(table[next] == 0) return;
+            home = indexHash(arena->index_offsets[table[next] - 1]) & mask;
+        } while(slot <= next ? (slot < home && home <= next)
+                             : (slot < home || home <= next));
+        table[slot] = table[next];
+        slot = next;
+    }
+}
+
+// Input: n - block size needed
+// Output: the entry for the free block of at least n bytes that the
+//         arena's policy picks, or -1 if there is none
+// Precondition: there is an index
+
+static int indexFit(vsize_t n)
+{
+    if(strategy == BEST_FIT) return indexBestFit(n);
+
+    const vsize_t *sizes = arena->index_sizes;
+    u_int32_t count = arena->index_count;
+    u_int32_t fits = 0;
+    int best = -1;
+
+    u_int32_t i;
+    for(i = 0; i < count; i++){
+        if(sizes[i] < n) continue;
+        fits++;
+        if(best < 0 || betterFit(sizes[i], sizes[best], fits)){
+            best = i;
+        }
+        if(strategy == FIRST_FIT) break;
+    }
+    return best;
+}
+
+// Input: size - a free block that fits; best - the one picked so far
+//        fits - # blocks that fit so far, counting this one
+// Output: TRUE if the arena's policy prefers size to best
+//
+// RANDOM_FIT keeps each of the blocks that fit with equal chance
+// (reservoir sampling).
+
+static int betterFit(vsize_t size, vsize_t best, u_int32_t fits)
+{
+    switch(strategy){
+    case WORST_FIT:
+        return size > best;
+    case RANDOM_FIT:
+        arena->seed ^= arena->seed << 13;
+        arena->seed ^= arena->seed >> 17;
+        arena->seed ^= arena->seed << 5;
+        return arena->seed % fits == 0;
+    case FIRST_FIT:
+        return FALSE;
+    default:
+        return size < best;
+    }
+}
+
+// Input: n - block size searched for; steps - # free blocks looked at
+//        found - TRUE if a block was found
+// Postcondition: the search is counted towards adaptPolicy's window
+
+static void countSearch(vsize_t n, u_int32_t steps, int found)
+{
+    arena->window_searches++;
+    arena->window_steps += steps;
+    arena->window_bytes += n;
+    if(!found){
+        arena->window_failures++;
+    }
+}
+
+// Postcondition: the arena's policy and split_min have been set from the
+//                last window of searches, and the window starts again
+//
+// Best fit places blocks well but looks at every free block; first fit
+// stops at the first that fits, which is as good while free space is in
+// one piece. The arena is under pressure if a search failed or under
+// 1/ADAPT_FREE_LOW of memory[] is free. Pressure, or free space of which
+// ADAPT_FRAG_HIGH% or more is outside the largest free block, switches
+// to best fit; free space back to under ADAPT_FRAG_LOW% outside it, with
+// searches looking at ADAPT_STEPS or more blocks on average, switches to
+// first fit. (In between, the policy stays as it is.)
+//
+// A split leaving less than split_min is not made: the whole block is
+// handed out instead. That wastes memory, so under pressure split_min
+// drops to split_low. Otherwise, if searches are long and over half the
+// free blocks are too small for a typical (mean) request, splits are
+// leaving slivers, so split_min is doubled (up to split_high). A
+// remainder as large as a typical request is no sliver, though, so it is
+// not doubled past the mean. Once under an eighth of the free blocks are
+// that small, or the requests have got smaller than split_min, it is
+// halved again.
+// Raising it only pays while memory is plentiful, so it waits for
+// 1/ADAPT_FREE_HIGH of memory[] to be free and for ADAPT_CALM windows
+// without pressure.
+
+static void adaptPolicy(void)
+{
+    vsize_t mean = arena->window_bytes / arena->window_searches;
+    u_int32_t steps = arena->window_steps / arena->window_searches;
+    u_int64_t total = 0;
+    vsize_t largest = 0;
+    u_int32_t blocks = 0, slivers = 0;
+
+    vaddr_t curr = free_list_ptr;
+    do{
+        free_header_t *block = makeRealPtr(curr);
+        total += block->size;
+        if(block->size > largest) largest = block->size;
+        if(block->size < mean) slivers++;
+        blocks++;
+        curr = block->next;
+    } while(curr != free_list_ptr);
+    u_int32_t frag = 100 - (u_int32_t) (100 * largest / total);
+    int pressure = arena->window_failures > 0 || total < memory_size / ADAPT_FREE_LOW;
+
+    if(pressure || frag >= ADAPT_FRAG_HIGH){
+        strategy = BEST_FIT;
+    } else if(frag < ADAPT_FRAG_LOW && steps >= ADAPT_STEPS){
+        strategy = FIRST_FIT;
+    }
+
+    if(pressure){
+        arena->split_min = arena->split_low;
+        arena->calm = 0;
+    } else if(arena->calm < ADAPT_CALM){
+        arena->calm++;
+    } else if(2 * slivers > blocks && steps >= ADAPT_STEPS
+              && total >= memory_size / ADAPT_FREE_HIGH
+              && 2 * arena->split_min <= mean
+              && arena->split_min < arena->split_high){
+        arena->split_min *= 2;
+        if(arena->split_min > arena->split_high){
+            arena->split_min = arena->split_high;
+        }
+    } else if((8 * slivers < blocks || arena->split_min > mean)
+              && arena->split_min > arena->split_low){
+        arena->split_min = multipleOfFour(arena->split_min / 2);
+        if(arena->split_min < arena->split_low){
+            arena->split_min = arena->split_low;
+        }
+    }
+
+    arena->window_searches = 0;
+    arena->window_steps = 0;
+    arena->window_failures = 0;
+    arena->window_bytes = 0;
+}
+
+// Input: n - block size needed
+// Output: the entry for the smallest free block of at least n bytes,
+//         or -1 if there is none
+// Precondition: there is an index
+//
+// Short indexes are scanned one entry at a time; longer ones by best_fit,
+// which uses the widest vector unit the CPU has. Each returns the first
+// of the smallest sizes, so the block chosen does not depend on which.
+
+static int indexBestFit(vsize_t n)
+{
+    if(arena->index_count < INDEX_SIMD_MIN){
+        return scanBestFit(arena->index_sizes, arena->index_count, n);
+    }
+    return best_fit(arena->index_sizes, arena->index_count, n);
+}
+
+// Postcondition: best_fit is the fastest search this CPU can run
+
+static void chooseBestFit(void)
+{
+    best_fit = scanBestFit;
+#ifdef INDEX_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        best_fit = bestFitAVX2;
+    } else if(__builtin_cpu_supports("sse4.1")){
+        best_fit = bestFitSSE41;
+    }
+#endif
+}
+
+// Input: sizes, count - an index's sizes[]; n - block size needed
+// Output: the first entry of the smallest size >= n, or -1 if none
+
+static int scanBestFit(const vsize_t *sizes, u_int32_t count, vsize_t n)
+{
+    return finishBestFit(sizes, count, n, 0, NULL, NULL, 0);
+}
+
+// Input: laneSizes, laneEntries - the smallest size >= n (NO_BLOCK if
+//                                 none) and its entry, found by each of
+//                                 `lanes` vector lanes in sizes[0..from)
+// Output: as for scanBestFit, having also scanned sizes[from..count)
+
+static int finishBestFit(const vsize_t *sizes, u_int32_t count, vsize_t n,
+                         u_int32_t from, const vsize_t *laneSizes,
+                         const u_int32_t *laneEntries, u_int32_t lanes)
+{
+    vsize_t bestSize = NO_BLOCK;
+    int best = -1;
+
+    u_int32_t i;
+    for(i = 0; i < lanes; i++){
+        if(laneSizes[i] == NO_BLOCK) continue;
+        if(best < 0 || laneSizes[i] < bestSize
+           || (laneSizes[i] == bestSize && laneEntries[i] < (u_int32_t) best)){
+            bestSize = laneSizes[i];
+            best = laneEntries[i];
+        }
+    }
+    for(i = from; i < count; i++){
+        if(sizes[i] >= n && sizes[i] < bestSize){
+            bestSize = sizes[i];
+            best = i;
+        }
+    }
+    return best;
+}
+
+#ifdef INDEX_SIMD
+
+// As scanBestFit, four entries at a time. Each lane keeps the smallest
+// fitting size it has seen and its entry; a size that does not fit counts
+// as NO_BLOCK (all ones), and only a strictly smaller size replaces the
+// lane's best, so each lane keeps the first of equal sizes.
+// (SSE4.1 is needed for the unsigned min/max and for blendv.)
+
+__attribute__((target("sse4.1")))
+static int bestFitSSE41(const vsize_t *sizes, u_int32_t count, vsize_t n)
+{
+    const __m128i need = _mm_set1_epi32(n);
+    const __m128i none = _mm_set1_epi32(NO_BLOCK);
+    const __m128i step = _mm_set1_epi32(4);
+    __m128i entry = _mm_setr_epi32(0, 1, 2, 3);
+    __m128i best = none;
+    __m128i where = none;
+
+    u_int32_t i;
+    for(i = 0; i + 4 <= count; i += 4){
+        __m128i size = _mm_loadu_si128((const __m128i *) (sizes + i));
+        __m128i fits = _mm_cmpeq_epi32(_mm_max_epu32(size, need), size);
+        __m128i key = _mm_blendv_epi8(none, size, fits);
+        __m128i less = _mm_andnot_si128(_mm_cmpeq_epi32(key, best),
+                                        _mm_cmpeq_epi32(_mm_min_epu32(key, best), key));
+        best = _mm_min_epu32(best, key);
+        where = _mm_blendv_epi8(where, entry, less);
+        entry = _mm_add_epi32(entry, step);
+    }
+
+    vsize_t laneSizes[4];
+    u_int32_t laneEntries[4];
+    _mm_storeu_si128((__m128i *) laneSizes, best);
+    _mm_storeu_si128((__m128i *) laneEntries, where);
+    return finishBestFit(sizes, count, n, i, laneSizes, laneEntries, 4);
+}
+
+// As bestFitSSE41, eight entries at a time
+
+__attribute__((target("avx2")))
+static int bestFitAVX2(const vsize_t *sizes, u_int32_t count, vsize_t n)
+{
+    const __m256i need = _mm256_set1_epi32(n);
+    const __m256i none = _mm256_set1_epi32(NO_BLOCK);
+    const __m256i step = _mm256_set1_epi32(8);
+    __m256i entry = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i best = none;
+    __m256i where = none;
+
+    u_int32_t i;
+    for(i = 0; i + 8 <= count; i += 8){
+        __m256i size = _mm256_loadu_si256((const __m256i *) (sizes + i));
+        __m256i fits = _mm256_cmpeq_epi32(_mm256_max_epu32(size, need), size);
+        __m256i key = _mm256_blendv_epi8(none, size, fits);
+        __m256i less = _mm256_andnot_si256(_mm256_cmpeq_epi32(key, best),
+                                           _mm256_cmpeq_epi32(_mm256_min_epu32(key, best), key));
+        best = _mm256_min_epu32(best, key);
+        where = _mm256_blendv_epi8(where, entry, less);
+        entry = _mm256_add_epi32(entry, step);
+    }
+
+    vsize_t laneSizes[8];
+    u_int32_t laneEntries[8];
+    _mm256_storeu_si256((__m256i *) laneSizes, best);
+    _mm256_storeu_si256((__m256i *) laneEntries, where);
+    return finishBestFit(sizes, count, n, i, laneSizes, laneEntries, 8);
+}
+
+#endif
+
+// Input: budget - most bytes of freed blocks to hold for quick reuse
+// Output: none
+// Precondition: allocator has been vlad_init()'d
+// Postcondition: with budget > 0, vlad_free puts blocks of up to
+//                CACHE_MAX_SIZE bytes in a per-size cache and vlad_malloc
+//                takes exact-size requests from it, so a free followed by
+//                a malloc of the same size does no merge or split; cached
+//                blocks are merged when the cache goes over budget or a
+//                request cannot otherwise be met. budget = 0 merges what
+//                is cached and goes back to coalescing on every free
+
+void vlad_set_lazy(u_int32_t budget)
+{
+    u_int32_t i;
+    for(i = 0; i < num_arenas; i++){
+        pthread_mutex_lock(&arenas[i].lock);
+        arena = &arenas[i];
+        if(budget < cache_bytes){
+            flushCache();
+        }
+        cache_budget = budget;
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+}
+
+// Input: slots - # entries handles[] is to have (more than it has)
+// Output: TRUE, or FALSE if mmap failed and handles[] is unchanged
+// Precondition: the caller holds the arena's lock
+// Postcondition: handles[] has slots entries, the new ones unused
+//
+// mmap'd, like huge_table[], so that the shim's malloc never calls itself
+// with the arena lock held.
+
+static int growHandles(u_int32_t slots)
+{
+    vaddr_t *handles = mmap(NULL, slots * sizeof(vaddr_t), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(handles == MAP_FAILED) return FALSE;
+
+    u_int32_t i;
+    for(i = 0; i < slots; i++){
+        handles[i] = (i < arena->handle_slots) ? arena->handles[i] : NO_BLOCK;
+    }
+    dropHandles();
+    arena->handles = handles;
+    arena->handle_slots = slots;
+    return TRUE;
+}
+
+// Postcondition: the arena being worked on has no handles[]
+
+static void dropHandles(void)
+{
+    if(arena->handles != NULL){
+        munmap(arena->handles, arena->handle_slots * sizeof(vaddr_t));
+    }
+    arena->handles = NULL;
+    arena->handle_slots = 0;
+}
+
+// Input: n - number of bytes requested
+// Output: a handle for a new block of at least n bytes, or 0
+// Precondition: as for vlad_malloc
+// Postcondition: vlad_handle_get(handle) gives the block's address, which
+//                stays the same until the next vlad_compact/_step
+//
+// Blocks allocated through handles are the only ones compaction may move.
+// The first word of the block records its handle slot, so a moved block
+// can update handles[] without a search; the caller's data follows it.
+
+vlad_handle_t vlad_handle_alloc(u_int32_t n)
+{
+    if(n > (u_int32_t) -1 - sizeof(vlink_t)) return 0;
+
+    byte *object = allocate(n + sizeof(vlink_t), NO_HINT, NULL);
+    if(object == NULL) return 0;
+
+    arena_t *owner = arena;
+    pthread_mutex_lock(&owner->lock);
+    arena = owner;
+
+    // find an unused slot, growing handles[] when they are all taken
+    u_int32_t slot = arena->handle_hint;
+    while(slot < arena->handle_slots && arena->handles[slot] != NO_BLOCK){
+        slot++;
+    }
+    if(slot == arena->handle_slots){
+        u_int32_t slots = (arena->handle_slots == 0) ? 64 : 2 * arena->handle_slots;
+        if(slots >= (1u << ARENA_SHIFT) || !growHandles(slots)){
+            arenaFree(object);
+            pthread_mutex_unlock(&owner->lock);
+            return 0;
+        }
+    }
+    arena->handle_hint = slot + 1;
+
+    alloc_header_t *block = (alloc_header_t *) (object - ALLOC_HEADER_SIZE);
+    block->magic = MAGIC_HANDLE;
+    *cacheLink(block) = slot;
+    arena->handles[slot] = makeOffsetPtr(block);
+
+    pthread_mutex_unlock(&owner->lock);
+    return ((owner - arenas) << ARENA_SHIFT) | (slot + 1);
+}
+
+// Input: handle - from vlad_handle_alloc
+// Output: the current address of the handle's block, or NULL
+//
+// The address is only good until the next vlad_compact, which may run on
+// another thread as soon as the arena's lock is let go.
+
+void *vlad_handle_get(vlad_handle_t handle)
+{
+    arena_t *owner = handleArena(handle);
+    if(owner == NULL) return NULL;
+
+    vaddr_t offset = owner->handles[(handle & ((1u << ARENA_SHIFT) - 1)) - 1];
+    pthread_mutex_unlock(&owner->lock);
+    return owner->start + offset + ALLOC_HEADER_SIZE + sizeof(vlink_t);
+}
+
+// Input: handle - from vlad_handle_alloc
+// Output: none
+// Postcondition: as for vlad_free on the handle's block; the handle is
+//                no longer valid
+
+void vlad_handle_free(vlad_handle_t handle)
+{
+    arena_t *owner = handleArena(handle);
+    if(owner == NULL){
+        fprintf(stderr, "vlad_handle_free: Attempt to free via invalid handle\n");
+        exit(EXIT_FAILURE);
+    }
+    arena = owner;
+
+    u_int32_t slot = (handle & ((1u << ARENA_SHIFT) - 1)) - 1;
+    alloc_header_t *block = makeRealPtr(arena->handles[slot]);
+    block->magic = MAGIC_ALLOC;
+    arena->handles[slot] = NO_BLOCK;
+    if(slot < arena->handle_hint){
+        arena->handle_hint = slot;
+    }
+    arenaFree((byte *) block + ALLOC_HEADER_SIZE);
+
+    pthread_mutex_unlock(&owner->lock);
+}
+
+// Input: handle - a handle
+// Output: the arena the handle belongs to, locked, or NULL if the handle
+//         is not in use
+//
+// handles[] is only read with the lock held: vlad_handle_alloc on another
+// thread may realloc it, and vlad_compact may change the offsets in it.
+
+static arena_t *handleArena(vlad_handle_t handle)
+{
+    u_int32_t index = handle >> ARENA_SHIFT;
+    u_int32_t slot = handle & ((1u << ARENA_SHIFT) - 1);
+
+    if(index >= num_arenas || slot == 0) return NULL;
+
+    arena_t *owner = &arenas[index];
+    pthread_mutex_lock(&owner->lock);
+    if(slot > owner->handle_slots || owner->handles[slot - 1] == NO_BLOCK){
+        pthread_mutex_unlock(&owner->lock);
+        return NULL;
+    }
+    return owner;
+}
+
+// Output: number of bytes moved
+// Postcondition: every block allocated through a handle has been slid
+//                toward offset 0 as far as the blocks allocated by
+//                vlad_malloc (which cannot move) allow. With no such
+//                blocks in the way, all free space is one block at the end.
+//
+// Pointers from vlad_handle_get are out of date after this.
+
+u_int32_t vlad_compact(void)
+{
+    return vlad_compact_step((u_int32_t) -1);
+}
+
+// Input: budget - roughly how many bytes may be moved by this call
+// Output: number of bytes moved (0 when there is nothing left to move)
+// Postcondition: as for vlad_compact, but stopping once budget bytes have
+//                been moved; the next call carries on from there (the walk
+//                restarts at offset 0, as the heap may have changed since)
+
+u_int32_t vlad_compact_step(u_int32_t budget)
+{
+    vsize_t moved = 0;
+    u_int32_t i;
+    for(i = 0; i < num_arenas && moved < budget; i++){
+        pthread_mutex_lock(&arenas[i].lock);
+        arena = &arenas[i];
+        moved += compactArena(budget - moved);
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    return moved;
+}
+
+// Input: budget - most bytes to move
+// Output: number of bytes moved in the arena being worked on
+//
+// Walking memory[] from offset 0, each handle block that comes
+// straight after a free block swaps places with it: the block is moved
+// down and the free block's header is rewritten after it, keeping its
+// place in the free list. Merging then joins that free block to any free
+// block beyond, so the gap carries on up through memory[].
+
+static vsize_t compactArena(vsize_t budget)
+{
+    vsize_t moved = 0;
+
+    // cached and remotely freed blocks would be holes that cannot move
+    drainRemoteFrees();
+    flushCache();
+
+    vaddr_t offset = 0;
+    while(offset < memory_size && moved < budget){
+        free_header_t *gap = makeRealPtr(offset);
+        vaddr_t nextOffset = offset + gap->size;
+
+        if(gap->magic != MAGIC_FREE || nextOffset >= memory_size){
+            offset = nextOffset;
+            continue;
+        }
+        alloc_header_t *block = makeRealPtr(nextOffset);
+        if(block->magic != MAGIC_HANDLE){
+            offset = nextOffset;
+            continue;
+        }
+
+        vsize_t gapSize = gap->size;
+        vsize_t blockSize = block->size;
+        vlink_t next = gap->next;
+        vlink_t prev = gap->prev;
+
+        memmove(gap, block, blockSize);
+        arena->handles[*cacheLink(gap)] = offset;
+
+        vaddr_t holeOffset = offset + blockSize;
+        moveFreeHeader(offset, holeOffset, gapSize, next, prev);
+        idlePages(holeOffset, gapSize);
+        vlad_merge();
+
+        moved += blockSize;
+        offset = holeOffset;
+    }
+
+    return moved;
+}
+
+// Input: decay - ms a page inside a free block must go unused before it
+//                is given back to the OS (0 = never, the default)
+//        interval - ms between purges by a background thread (0 = none:
+//                   pages are only given back by vlad_purge)
+// Output: 0, or -1 if there was no memory to keep track of the pages or
+//         the thread could not be started (pages are then never given back)
+// Precondition: allocator has been vlad_init()'d
+// Postcondition: vlad_purge (and the thread) may madvise(MADV_DONTNEED)
+//                whole pages of free blocks that have been idle for decay ms
+//
+// Each arena keeps a time stamp per page of memory[], set whenever the
+// page becomes part of a free block. Only vlad_free pays for this (one
+// read of a coarse clock); vlad_malloc does not look at the stamps. A page
+// given back reads as zero the next time it is touched, which is all that
+// vlad_calloc's use of dirty_end needs.
+
+int vlad_set_decay(u_int32_t decay, u_int32_t interval)
+{
+    stopPurgeThread();
+    atomic_store(&purge_decay, decay);
+
+    int result = 0;
+    u_int32_t i;
+    for(i = 0; i < num_arenas; i++){
+        pthread_mutex_lock(&arenas[i].lock);
+        arena = &arenas[i];
+        if(decay == 0){
+            dropPageIdle();
+        } else if(arena->page_idle == NULL && !buildPageIdle()){
+            result = -1;
+        }
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+
+    if(result == 0 && decay > 0 && interval > 0){
+        purge_interval = interval;
+        if(pthread_create(&purge_thread, NULL, purgeThread, NULL) != 0){
+            purge_interval = 0;
+            result = -1;
+        }
+    }
+    if(result != 0 && decay > 0){
+        vlad_set_decay(0, 0);
+    }
+    return result;
+}
+
+// Input: budget - roughly how many bytes may be given back by this call
+// Output: number of bytes given back to the OS
+// Postcondition: as many as budget bytes of the pages that have been idle
+//                for the vlad_set_decay time are given back, each arena
+//                in turn; the next call carries on with what is left
+//
+// Each arena is locked while its pages are given back, as a block could
+// otherwise be handed out from a page being dropped. A small budget keeps
+// that short.
+
+u_int32_t vlad_purge(u_int32_t budget)
+{
+    vsize_t purged = 0;
+    u_int32_t i;
+    for(i = 0; i < num_arenas && purged < budget; i++){
+        pthread_mutex_lock(&arenas[i].lock);
+        arena = &arenas[i];
+        purged += purgeArena(budget - purged);
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    return purged;
+}
+
+// Input: budget - most bytes to give back
+// Output: number of bytes given back in the arena being worked on
+//
+// Only the whole pages of a free block past its header are looked at; the
+// header, and the one of the block after, are on pages kept in memory.
+// Pages are numbered from the start of the mapping, MAP_LEAD bytes
+// before memory[].
+
+static vsize_t purgeArena(vsize_t budget)
+{
+    if(arena->page_idle == NULL) return 0;
+
+    // read under the lock, so that no stamp is later than now
+    u_int64_t now = msNow();
+    u_int64_t decay = atomic_load(&purge_decay);
+    vsize_t pageSize = 1u << page_shift;
+    vsize_t purged = 0;
+
+    vaddr_t curr = free_list_ptr;
+    do{
+        free_header_t *block = makeRealPtr(curr);
+        u_int32_t page = (curr + MAP_LEAD + FREE_HEADER_SIZE + pageSize - 1) >> page_shift;
+        u_int32_t end = ((u_int64_t) curr + MAP_LEAD + block->size) >> page_shift;
+
+        while(page < end && purged < budget){
+            // a run of idle pages, given back with one madvise
+            u_int32_t first = page;
+            while(page < end && purged + (page - first) * pageSize < budget
+                  && arena->page_idle[page] != PAGE_CLEAN
+                  && arena->page_idle[page] + decay <= now){
+                page++;
+            }
+            if(page == first){
+                page++;
+                continue;
+            }
+            vsize_t bytes = (page - first) * pageSize;
+            if(madvise(memory - MAP_LEAD + (first << page_shift), bytes, MADV_DONTNEED) == 0){
+                while(first < page){
+                    arena->page_idle[first++] = PAGE_CLEAN;
+                }
+                purged += bytes;
+            }
+        }
+        curr = block->next;
+    } while(curr != free_list_ptr && purged < budget);
+
+    return purged;
+}
+
+// Output: TRUE, or FALSE if there was no memory
+// Postcondition: the arena being worked on has a stamp for each page, and
+//                the pages of its free blocks are idle from now
+
+static int buildPageIdle(void)
+{
+    u_int32_t pages = ((u_int64_t) arena->mapped + (1u << page_shift) - 1) >> page_shift;
+    u_int64_t *stamps = mmap(NULL, pages * sizeof(u_int64_t), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(stamps == MAP_FAILED) return FALSE;
+
+    // mmap'd, so every page starts out PAGE_CLEAN; those of free blocks
+    // outside dirty_end..dirty_top may have been used before now, though
+    arena->page_idle = stamps;
+    arena->pages = pages;
+    idleFreeList(dirty_end, arena->dirty_top);
+    return TRUE;
+}
+
+// Postcondition: the arena being worked on has no page stamps
+
+static void dropPageIdle(void)
+{
+    if(arena->page_idle != NULL){
+        munmap(arena->page_idle, arena->pages * sizeof(u_int64_t));
+    }
+    arena->page_idle = NULL;
+    arena->pages = 0;
+}
+
+// Input: clean, cleanEnd - memory[] indexes of the first byte that has
+//                          never been used and of the next one that has
+// Postcondition: every page of every free block, outside clean..cleanEnd,
+//                is idle from now
+
+static void idleFreeList(vaddr_t clean, vaddr_t cleanEnd)
+{
+    vaddr_t curr = free_list_ptr;
+    do{
+        free_header_t *block = makeRealPtr(curr);
+        vaddr_t end = curr + block->size;
+        if(curr < clean){
+            idlePages(curr, ((end < clean) ? end : clean) - curr);
+        }
+        if(end > cleanEnd){
+            vaddr_t from = (curr > cleanEnd) ? curr : cleanEnd;
+            idlePages(from, end - from);
+        }
+        curr = block->next;
+    } while(curr != free_list_ptr);
+}
+
+// Input: offset, size - bytes of memory[] that are now part of a free
+//                       block, and may have been written
+// Postcondition: if pages are being stamped, theirs are idle from now
+
+static void idlePages(vaddr_t offset, vsize_t size)
+{
+    if(arena->page_idle == NULL) return;
+
+    u_int64_t now = msNow();
+    u_int32_t page = (offset + MAP_LEAD) >> page_shift;
+    u_int32_t last = ((u_int64_t) offset + MAP_LEAD + size - 1) >> page_shift;
+    while(page <= last){
+        arena->page_idle[page++] = now;
+    }
+}
+
+// Output: ms on the coarse monotonic clock (never PAGE_CLEAN in practice)
+
+static u_int64_t msNow(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (u_int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// The background thread of vlad_set_decay: every purge_interval ms, give
+// back all idle pages, PURGE_STEP bytes at a time so that no arena stays
+// locked for long; stopPurgeThread wakes it to stop.
+
+static void *purgeThread(void *unused)
+{
+    pthread_mutex_lock(&purge_lock);
+    while(purge_interval > 0){
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        u_int64_t ns = until.tv_nsec + (u_int64_t) purge_interval * 1000000;
+        until.tv_sec += ns / 1000000000;
+        until.tv_nsec = ns % 1000000000;
+        pthread_cond_timedwait(&purge_wake, &purge_lock, &until);
+        if(purge_interval == 0) break;
+
+        pthread_mutex_unlock(&purge_lock);
+        while(vlad_purge(PURGE_STEP) >= PURGE_STEP);
+        pthread_mutex_lock(&purge_lock);
+    }
+    pthread_mutex_unlock(&purge_lock);
+    return NULL;
+}
+
+// Postcondition: the purge thread, if there was one, has finished
+
+static void stopPurgeThread(void)
+{
+    pthread_mutex_lock(&purge_lock);
+    u_int32_t running = purge_interval;
+    purge_interval = 0;
+    pthread_cond_signal(&purge_wake);
+    pthread_mutex_unlock(&purge_lock);
+
+    if(running > 0){
+        pthread_join(purge_thread, NULL);
+    }
+}
+
+// Output: a snapshot of the whole allocator, or NULL if out of memory
+// Precondition: allocator has been vlad_init()'d
+// Postcondition: vlad_restore(snapshot) will put every arena back exactly
+//                as it is now
+//
+// Vlad's state is just memory[] and a few fields per arena, so each arena
+// is saved with one memcpy of memory[] and one of its heap state. The
+// copies are mmap'd, as they are made with the arena locks held and the
+// shim's malloc would wait on them.
+
+vlad_snapshot_t *vlad_snapshot(void)
+{
+    if(num_arenas == 0) return NULL;
+
+    vlad_snapshot_t *snapshot = calloc(1, sizeof(vlad_snapshot_t)
+                                       + num_arenas * sizeof(struct saved_arena));
+    if(snapshot == NULL) return NULL;
+    snapshot->num_arenas = num_arenas;
+
+    lockAll();
+    u_int32_t i;
+    for(i = 0; i < num_arenas; i++){
+        struct saved_arena *saved = &snapshot->saved[i];
+        arena = &arenas[i];
+
+        // blocks waiting on the remote free stack cannot be saved
+        drainRemoteFrees();
+
+        byte *bytes = mmap(NULL, memory_size + arena->handle_slots * sizeof(vaddr_t),
+                           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(bytes == MAP_FAILED){
+            snapshot->num_arenas = i;
+            unlockAll();
+            vlad_snapshot_free(snapshot);
+            return NULL;
+        }
+
+        saved->bytes = bytes;
+        saved->handles = (vaddr_t *) (bytes + memory_size);
+        memcpy(saved->bytes, memory, memory_size);
+        memcpy((byte *) &saved->state + STATE_START,
+               (byte *) arena + STATE_START, STATE_SIZE);
+        if(arena->handle_slots > 0){
+            memcpy(saved->handles, arena->handles,
+                   arena->handle_slots * sizeof(vaddr_t));
+        }
+    }
+    unlockAll();
+
+    return snapshot;
+}
+
+// Input: snapshot - from vlad_snapshot
+// Output: 0, or -1 if the arenas are not laid out as in the snapshot
+// Precondition: the allocator has the same arenas (number and sizes) as
+//               when the snapshot was taken, e.g. it has not been ended
+// Postcondition: every arena is as it was when the snapshot was taken;
+//                pointers and handles from after that are invalid
+
+int vlad_restore(vlad_snapshot_t *snapshot)
+{
+    if(snapshot == NULL || snapshot->num_arenas != num_arenas) return -1;
+
+    u_int32_t i;
+    for(i = 0; i < num_arenas; i++){
+        if(snapshot->saved[i].state.size != arenas[i].size) return -1;
+    }
+
+    lockAll();
+    for(i = 0; i < num_arenas; i++){
+        struct saved_arena *saved = &snapshot->saved[i];
+        arena = &arenas[i];
+
+        // handles[] may have grown since; it never needs to shrink
+        if(saved->state.handle_slots > arena->handle_slots
+           && !growHandles(saved->state.handle_slots)){
+            unlockAll();
+            return -1;
+        }
+        vsize_t slots = arena->handle_slots;
+
+        memcpy(memory, saved->bytes, memory_size);
+        memcpy((byte *) arena + STATE_START,
+               (byte *) &saved->state + STATE_START, STATE_SIZE);
+        if(saved->state.handle_slots > 0){
+            memcpy(arena->handles, saved->handles,
+                   saved->state.handle_slots * sizeof(vaddr_t));
+        }
+        // keep the larger table, with the extra slots unused
+        while(arena->handle_slots < slots){
+            arena->handles[arena->handle_slots++] = NO_BLOCK;
+        }
+        atomic_store(&remote_free_head, NO_BLOCK);
+
+        // the free list is a different one now (if this fails, the
+        // index is off, and counted as lost)
+        if(arena->index_sizes != NULL){
+            dropIndex();
+            if(!buildIndex()){
+                arena->index_lost++;
+            }
+        }
+        // ... and all of memory[] has just been written
+        if(arena->page_idle != NULL){
+            idleFreeList(memory_size, memory_size);
+        }
+    }
+    unlockAll();
+
+    // the blocks that were sampled may not be there any more
+    clearSamples();
+    return 0;
+}
+
+// Postcondition: the memory used by snapshot has been released
+
+void vlad_snapshot_free(vlad_snapshot_t *snapshot)
+{
+    if(snapshot == NULL) return;
+
+    u_int32_t i;
+    for(i = 0; i < snapshot->num_arenas; i++){
+        struct saved_arena *saved = &snapshot->saved[i];
+        munmap(saved->bytes, saved->state.size
+                             + saved->state.handle_slots * sizeof(vaddr_t));
+    }
+    free(snapshot);
+}
+
+// Postcondition: the calling thread holds every arena's lock
+// (always taken in index order, so two callers cannot deadlock)
+
+static void lockAll(void)
+{
+    u_int32_t i;
+    for(i = 0; i < num_arenas; i++){
+        pthread_mutex_lock(&arenas[i].lock);
+    }
+}
+
+static void unlockAll(void)
+{
+    u_int32_t i;
+    for(i = 0; i < num_arenas; i++){
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+}
+
+// Input: from - memory[] index of a free block's old header
+//        to - where its header is to be written
+//        size, next, prev - the block's size and free list links
+//                           (read before the old header was overwritten)
+// Postcondition: the free block starts at `to`, in the same place in the
+//                free list as before
+
+static void moveFreeHeader(vaddr_t from, vaddr_t to, vsize_t size,
+                           vlink_t next, vlink_t prev)
+{
+    free_header_t *header = makeRealPtr(to);
+    header->magic = MAGIC_FREE;
+    header->size = size;
+    if(next == from){
+        header->next = to;
+        header->prev = to;
+    } else {
+        header->next = next;
+        header->prev = prev;
+        ((free_header_t *) makeRealPtr(prev))->next = to;
+        ((free_header_t *) makeRealPtr(next))->prev = to;
+    }
+    if(free_list_ptr == from){
+        free_list_ptr = to;
+    }
+    if(arena->victim == from){
+        arena->victim = to;
+    }
+    indexMove(from, to, size);
+}
+
+// Output: the thread's home arena, locked; `arena` is set to it
+//
+// A thread's first home is picked by a hash of its thread id. Each time
+// the lock is found busy the thread counts a miss (and so does the
+// arena); after CONTENTION_LIMIT misses it moves to whichever arena (on
+// the same NUMA node) has seen the fewest.
+
+static arena_t *lockHomeArena(void)
+{
+    if(home_arena == NULL || home_arena - arenas >= num_arenas){
+        u_int64_t id = (u_int64_t) pthread_self();
+        home_arena = &arenas[((id * 0x9E3779B97F4A7C15ULL) >> 32) % num_arenas];
+        home_misses = 0;
+
+        // in NUMA mode, use the arena on the node this thread runs on
+        if(arenas[0].node >= 0){
+            int node = currentNode();
+            u_int32_t i;
+            for(i = 0; i < num_arenas; i++){
+                if(arenas[i].node == node) home_arena = &arenas[i];
+            }
+        }
+    }
+
+    if(pthread_mutex_trylock(&home_arena->lock) != 0){
+        atomic_fetch_add_explicit(&home_arena->contention, 1, memory_order_relaxed);
+        home_misses++;
+        if(home_misses >= CONTENTION_LIMIT){
+            u_int32_t i;
+            for(i = 0; i < num_arenas; i++){
+                if(arenas[i].node == home_arena->node
+                   && atomic_load_explicit(&arenas[i].contention, memory_order_relaxed)
+                   < atomic_load_explicit(&home_arena->contention, memory_order_relaxed)){
+                    home_arena = &arenas[i];
+                }
+            }
+            home_misses = 0;
+        }
+        pthread_mutex_lock(&home_arena->lock);
+    }
+
+    arena = home_arena;
+    return home_arena;
+}
+
+// Input: nodes - array to fill in; max - size of that array
+// Output: number of NUMA nodes online (0 if this is not known), with
+//         their numbers in nodes[]
+//
+// The kernel lists online nodes as ranges, e.g. "0" or "0-1,4-5"
+
+static u_int32_t onlineNodes(int *nodes, u_int32_t max)
+{
+    FILE *list = fopen(NODE_LIST, "r");
+    if(list == NULL) return 0;
+
+    u_int32_t n = 0;
+    int first, last;
+    while(n < max && fscanf(list, "%d", &first) == 1){
+        last = first;
+        int c = fgetc(list);
+        if(c == '-'){
+            if(fscanf(list, "%d", &last) != 1) break;
+            c = fgetc(list);
+        }
+        while(first <= last && first < 8 * (int) sizeof(unsigned long) && n < max){
+            nodes[n++] = first++;
+        }
+        if(c != ',') break;
+    }
+    fclose(list);
+    return n;
+}
+
+// Output: the NUMA node the calling thread is running on (0 if unknown)
+
+static int currentNode(void)
+{
+    unsigned int cpu, node;
+    if(syscall(SYS_getcpu, &cpu, &node, NULL) != 0){
+        return 0;
+    }
+    return node;
+}
+
+// Input: object - a pointer
+// Output: the arena whose memory[] holds object, or NULL
+
+static arena_t *findArena(void *object)
+{
+    u_int32_t i;
+    for(i = 0; i < num_arenas; i++){
+        byte *start = arenas[i].start;
+        if((byte *) object > start && (byte *) object < start + arenas[i].size){
+            return &arenas[i];
+        }
+    }
+    return NULL;
+}
+
+// a cached block keeps the index of the next block in its bin
+// in the first word after its header
+
+static vlink_t *cacheLink(void *block){
+
+    return (vlink_t *) ((byte *) block + ALLOC_HEADER_SIZE);
+}
+
+// Input: current state of the memory[]
+// Output: new state, where any adjacent blocks in the free list
+//            have been combined into a single larger block; after this,
+//            there should be no region in the free list whose next
+//            reference is to a location just past the end of the region
+
+static void vlad_merge()
+{
+    free_header_t *curr = makeRealPtr(free_list_ptr);
+    int firstLoop = TRUE;
+    int i = 0;
+
+    while(i < 2){
+
+        firstLoop = TRUE;
+        curr = makeRealPtr(free_list_ptr);
+        while(curr != makeRealPtr(free_list_ptr) || firstLoop == TRUE){
             if(adjacent(curr)){
                 free_header_t *prev = makeRealPtr(curr->prev);
                 free_header_t *next = makeRealPtr(curr->next);
                 free_header_t *nextRegion = (free_header_t*) ((void*)(curr) + curr->size);
                 free_header_t *temp = nextRegion;
 
-                curr->size += nextRegion->size;
-                next = makeRealPtr(nextRegion->next);
-                prev = makeRealPtr(nextRegion->prev);
+                curr->size += nextRegion->size;
+                merge_count++;
+                next = makeRealPtr(nextRegion->next);
+                prev = makeRealPtr(nextRegion->prev);
+
+                prev->next = makeOffsetPtr(next);
+                next->prev = makeOffsetPtr(prev);
+                
+                firstLoop = FALSE;
+
+                temp->magic = 0;
+                temp->size = 0;
+                temp->next = 0;
+                temp->prev = 0;
+                indexDrop(makeOffsetPtr(temp));
+                idlePages(makeOffsetPtr(temp), FREE_HEADER_SIZE);
+                if(arena->victim == makeOffsetPtr(temp)){
+                    arena->victim = NO_BLOCK;
+                }
+                indexMove(makeOffsetPtr(curr), makeOffsetPtr(curr), curr->size);
+
+                // time to go through memory and find the first free region
+                // update free_list_ptr
+                
+                curr = makeRealPtr(0);
+                do{
+                    if(curr->magic != MAGIC_FREE){
+                        curr = makeRealPtr(makeOffsetPtr(curr) + curr->size);
+                    } else {
+                        break;
+                    }
+                } while(curr != makeRealPtr(memory_size));
+                
+                free_list_ptr = makeOffsetPtr(curr);
+
+            } else if(curr->next == free_list_ptr){
+                break;
+            } 
+            curr = makeRealPtr(curr->next);
+        }
+        i++;
+    }
+}
+
+// ** Complete **
+static u_int32_t adjacent(free_header_t *ptr){
+
+    int result = TRUE;
+
+    free_header_t *nextRegion = (free_header_t*) ((void*)(ptr) + ptr->size);
+
+    // if at the end of list, wrap back around to beginning
+    if(makeOffsetPtr(nextRegion) == memory_size){
+        nextRegion = makeRealPtr(0);
+        result = FALSE;
+    }
+    if(nextRegion->magic != MAGIC_FREE){
+        return FALSE;
+    }
+    return result;
+}
+
+// Input: n - request size from which blocks get their own mapping
+//            (0 = never, the default)
+// Postcondition: each later request for n bytes or more is given its own
+//                page-aligned mmap, outside every arena, and its memory
+//                is returned to the system as soon as it is freed
+//
+// Huge blocks do not fragment the arenas, so these need not be sized for
+// the biggest buffer; vlad_realloc grows them with mremap, which moves
+// page mappings instead of copying bytes. They are not part of snapshots,
+// and vlad_profile does not sample them.
+
+void vlad_set_mmap_threshold(u_int32_t n)
+{
+    atomic_store(&huge_threshold, n);
+}
+
+static int wantHuge(u_int32_t n)
+{
+    u_int32_t threshold = atomic_load_explicit(&huge_threshold, memory_order_relaxed);
+    return threshold > 0 && n >= threshold;
+}
+
+// Input: alignment - a power of two, at most the page size
+//        n - number of bytes requested
+// Output: a pointer to n zero bytes at a multiple of alignment (and of
+//         HUGE_HEADER_SIZE) in a mapping of their own, or NULL
+//
+// The header goes just before the block, in the mapping's first page, so
+// the start of the mapping is found by rounding the header down to a page.
+
+static void *hugeAlloc(u_int32_t alignment, u_int32_t n)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t lead = alignment > HUGE_HEADER_SIZE ? alignment : HUGE_HEADER_SIZE;
+    if(lead > page) return NULL;
+
+    size_t length = (lead + n + page - 1) & ~(page - 1);
+    byte *base = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED) return NULL;
+
+    huge_header_t *header = (huge_header_t *) (base + lead - HUGE_HEADER_SIZE);
+    header->length = length;
+    header->magic = MAGIC_MMAP;
+    header->requested = n;
+
+    pthread_mutex_lock(&huge_lock);
+    if(!addHuge(header)){
+        pthread_mutex_unlock(&huge_lock);
+        munmap(base, length);
+        return NULL;
+    }
+    header->prev = NULL;
+    header->next = huge_list;
+    if(huge_list != NULL){
+        huge_list->prev = header;
+    }
+    huge_list = header;
+    huge_count++;
+    huge_bytes += length;
+    pthread_mutex_unlock(&huge_lock);
+
+    return base + lead;
+}
+
+// Input: object - any pointer
+// Output: the header of the huge block at object, or NULL if there is none
+// Precondition: the caller holds huge_lock
+//
+// This runs for every pointer that is in no arena (under the shim, every
+// free of memory from the next malloc), so it looks the header up in
+// huge_table[] rather than walking huge_list. The header is never read
+// unless it is found: object may be at the start of someone else's page.
+
+static huge_header_t *findHuge(void *object)
+{
+    if(huge_slots == 0) return NULL;
+
+    huge_header_t *header = (huge_header_t *) ((byte *) object - HUGE_HEADER_SIZE);
+    u_int32_t mask = huge_slots - 1;
+    u_int32_t i = hugeHash(header) & mask;
+    while(huge_table[i] != NULL){
+        if(huge_table[i] == header) return header;
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+// Input: header - of a huge block not yet in huge_table[]
+// Output: TRUE, or FALSE if the table was full and could not grow
+// Precondition: the caller holds huge_lock
+
+static int addHuge(huge_header_t *header)
+{
+    // keep the table at most half full, so that probes stay short
+    if(2 * (huge_count + 1) > huge_slots && !growHugeTable()) return FALSE;
+
+    u_int32_t mask = huge_slots - 1;
+    u_int32_t i = hugeHash(header) & mask;
+    while(huge_table[i] != NULL){
+        i = (i + 1) & mask;
+    }
+    huge_table[i] = header;
+    return TRUE;
+}
+
+// Input: header - of a huge block in huge_table[]
+// Postcondition: it is no longer in the table, and the entries after it
+//                that would no longer be found by a linear probe have
+//                moved back (as in dropSample)
+// Precondition: the caller holds huge_lock
+
+static void dropHuge(huge_header_t *header)
+{
+    u_int32_t mask = huge_slots - 1;
+    u_int32_t i = hugeHash(header) & mask;
+    while(huge_table[i] != header){
+        i = (i + 1) & mask;
+    }
+
+    u_int32_t j = i;
+    for(;;){
+        huge_table[i] = NULL;
+        u_int32_t home;
+        do{
+            j = (j + 1) & mask;
+            if(huge_table[j] == NULL) return;
+            home = hugeHash(huge_table[j]) & mask;
+        } while(i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        huge_table[i] = huge_table[j];
+        i = j;
+    }
+}
+
+// Output: TRUE if huge_table[] now has twice as many entries (or its
+//         first HUGE_SLOTS), FALSE if mmap failed and it is unchanged
+// Precondition: the caller holds huge_lock
+//
+// mmap'd, like samples[], so that the shim's malloc never calls itself.
+
+static int growHugeTable(void)
+{
+    u_int32_t slots = huge_slots > 0 ? 2 * huge_slots : HUGE_SLOTS;
+    huge_header_t **table = mmap(NULL, slots * sizeof(huge_header_t *),
+                                 PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(table == MAP_FAILED) return FALSE;
+
+    u_int32_t i;
+    for(i = 0; i < huge_slots; i++){
+        if(huge_table[i] == NULL) continue;
+        u_int32_t j = hugeHash(huge_table[i]) & (slots - 1);
+        while(table[j] != NULL){
+            j = (j + 1) & (slots - 1);
+        }
+        table[j] = huge_table[i];
+    }
+    if(huge_slots > 0){
+        munmap(huge_table, huge_slots * sizeof(huge_header_t *));
+    }
+    huge_table = table;
+    huge_slots = slots;
+    return TRUE;
+}
+
+static u_int32_t hugeHash(huge_header_t *header)
+{
+    return ((u_int64_t) (uintptr_t) header * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
+static byte *hugeBase(huge_header_t *header)
+{
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    return (byte *) ((uintptr_t) header & ~(page - 1));
+}
+
+// Input: object - a pointer that is in no arena
+// Output: TRUE if object was a huge block, which has now been unmapped;
+//         FALSE if it is not a huge block
+
+static int freeHuge(void *object)
+{
+    pthread_mutex_lock(&huge_lock);
+    huge_header_t *header = findHuge(object);
+    if(header != NULL){
+        dropHuge(header);
+        if(header->prev != NULL){
+            header->prev->next = header->next;
+        } else {
+            huge_list = header->next;
+        }
+        if(header->next != NULL){
+            header->next->prev = header->prev;
+        }
+        huge_count--;
+        huge_bytes -= header->length;
+    }
+    pthread_mutex_unlock(&huge_lock);
+
+    if(header == NULL) return FALSE;
+    munmap(hugeBase(header), header->length);
+    return TRUE;
+}
+
+// Input: object - a pointer that is in no arena; n - number of bytes now needed
+// Output: FALSE if object is not a huge block; otherwise TRUE, with *moved
+//         set to the block resized (and perhaps moved) by mremap, or to
+//         NULL if there is no room, in which case object is unchanged
+
+static int reallocHuge(void *object, u_int32_t n, void **moved)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    pthread_mutex_lock(&huge_lock);
+    huge_header_t *header = findHuge(object);
+    if(header == NULL){
+        pthread_mutex_unlock(&huge_lock);
+        return FALSE;
+    }
+
+    byte *base = hugeBase(header);
+    size_t lead = (byte *) object - base;
+    size_t length = (lead + n + page - 1) & ~(page - 1);
+    if(length != header->length){
+        byte *mapped = (byte *) syscall(SYS_mremap, base, header->length,
+                                        length, MREMAP_MAYMOVE);
+        if(mapped == MAP_FAILED){
+            pthread_mutex_unlock(&huge_lock);
+            *moved = NULL;
+            return TRUE;
+        }
+        // the old header has moved with the rest of the mapping (a
+        // table entry is freed first, so adding it back cannot fail)
+        dropHuge(header);
+        huge_bytes += length;
+        header = (huge_header_t *) (mapped + lead - HUGE_HEADER_SIZE);
+        addHuge(header);
+        huge_bytes -= header->length;
+        header->length = length;
+        if(header->prev != NULL){
+            header->prev->next = header;
+        } else {
+            huge_list = header;
+        }
+        if(header->next != NULL){
+            header->next->prev = header;
+        }
+        object = mapped + lead;
+    }
+    header->requested = n;
+    pthread_mutex_unlock(&huge_lock);
+
+    *moved = object;
+    return TRUE;
+}
+
+// Input: rate - sample about one allocation per "rate" bytes allocated
+//               (0 = stop sampling)
+// Postcondition: from now on, the call stack of each sampled vlad_malloc,
+//                vlad_calloc or vlad_aligned_alloc is kept until its block
+//                is freed; vlad_profile_dump writes out what is kept
+//
+// Each thread counts down the bytes it allocates, and the allocation that
+// takes the count to zero is sampled, so a sample of an n byte block
+// stands for rate / n blocks like it (just itself, if n >= rate).
+// Samples are kept in a hash table of their own, keyed by arena and
+// memory[] index, and mmap'd so that the profiler never calls malloc.
+
+void vlad_profile(u_int32_t rate)
+{
+    atomic_store(&profile_rate, rate);
+}
+
+// Input: object, n - a block just returned for a request of n bytes
+// Postcondition: if this thread has allocated "rate" bytes since its last
+//                sample, the block's call stack is in samples[]
+
+static void profileAlloc(void *object, u_int32_t n)
+{
+    u_int32_t rate = atomic_load_explicit(&profile_rate, memory_order_relaxed);
+    if(rate == 0 || object == NULL) return;
+
+    profile_countdown -= n;
+    if(profile_countdown > 0) return;
+    while(profile_countdown <= 0){
+        profile_countdown += rate;
+    }
+
+    sample_t sample;
+    sample.size = n;
+    sample.weight = (n >= rate || n == 0) ? 1 : rate / n;
+    sample.depth = backtrace(sample.stack, PROFILE_DEPTH);
+
+    // the stack starts in here
+    if(sample.depth > PROFILE_SKIP){
+        sample.depth -= PROFILE_SKIP;
+        memmove(sample.stack, sample.stack + PROFILE_SKIP,
+                sample.depth * sizeof(void *));
+    }
+
+    arena_t *owner = findArena(object);
+    if(owner == NULL) return;
+    sample.arena = owner - arenas + 1;
+    sample.offset = (byte *) object - ALLOC_HEADER_SIZE - owner->start;
+
+    pthread_mutex_lock(&profile_lock);
+    if(2 * (sample_count + 1) > sample_slots){
+        growSamples();
+    }
+    if(2 * (sample_count + 1) <= sample_slots){
+        u_int32_t mask = sample_slots - 1;
+        u_int32_t i = sampleHash(sample.arena, sample.offset) & mask;
+        while(samples[i].arena != 0
+              && (samples[i].arena != sample.arena
+                  || samples[i].offset != sample.offset)){
+            i = (i + 1) & mask;
+        }
+        if(samples[i].arena == 0){
+            sample_count++;
+        }
+        samples[i] = sample;
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+// Input: object - a block about to be freed
+// Postcondition: the block's sample (if any) has been dropped
 
-                prev->next = makeOffsetPtr(next);
-                next->prev = makeOffsetPtr(prev);
-                
-                firstLoop = FALSE;
+static void profileFree(void *object)
+{
+    if(atomic_load_explicit(&sample_count, memory_order_relaxed) == 0) return;
 
-                temp->magic = 0;
-                temp->size = 0;
-                temp->next = 0;
-                temp->prev = 0;
+    arena_t *owner = findArena(object);
+    if(owner == NULL) return;
+    u_int32_t index = owner - arenas + 1;
+    vaddr_t offset = (byte *) object - ALLOC_HEADER_SIZE - owner->start;
 
-                // time to go through memory and find the first free region
-                // update free_list_ptr
-                
-                curr = makeRealPtr(0);
-                do{
-                    if(curr->magic != MAGIC_FREE){
-                        curr = makeRealPtr(makeOffsetPtr(curr) + curr->size);
-                    } else {
-                        break;
-                    }
-                } while(curr != makeRealPtr(4096));
-                
-                free_list_ptr = makeOffsetPtr(curr);
+    pthread_mutex_lock(&profile_lock);
+    sample_t *sample = findSample(index, offset);
+    if(sample != NULL){
+        dropSample(sample - samples);
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
 
-            } else if(curr->next == free_list_ptr){
-                break;
-            } 
-            curr = makeRealPtr(curr->next);
+// Input: index - arenas[] index + 1; offset - memory[] index of a block
+// Output: the block's entry in samples[], or NULL if it was not sampled
+// Precondition: the caller holds profile_lock
+
+static sample_t *findSample(u_int32_t index, vaddr_t offset)
+{
+    if(sample_slots == 0) return NULL;
+
+    u_int32_t mask = sample_slots - 1;
+    u_int32_t i = sampleHash(index, offset) & mask;
+    while(samples[i].arena != 0){
+        if(samples[i].arena == index && samples[i].offset == offset){
+            return &samples[i];
         }
-        i++;
+        i = (i + 1) & mask;
     }
+    return NULL;
 }
 
-// ** Complete **
-static u_int32_t adjacent(free_header_t *ptr){
+// Input: i - an entry in use in samples[]
+// Postcondition: the entry is unused, and the entries after it that would
+//                no longer be found by a linear probe have moved back
+// Precondition: the caller holds profile_lock
 
-    int result = TRUE;
+static void dropSample(u_int32_t i)
+{
+    u_int32_t mask = sample_slots - 1;
+    u_int32_t j = i;
 
-    free_header_t *nextRegion = (free_header_t*) ((void*)(ptr) + ptr->size);
+    sample_count--;
+    for(;;){
+        samples[i].arena = 0;
+        u_int32_t home;
+        do{
+            j = (j + 1) & mask;
+            if(samples[j].arena == 0) return;
+            home = sampleHash(samples[j].arena, samples[j].offset) & mask;
+        } while(i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        samples[i] = samples[j];
+        i = j;
+    }
+}
 
-    // if at the end of list, wrap back around to beginning
-    if(makeOffsetPtr(nextRegion) == 4096){
-        nextRegion = makeRealPtr(0);
-        result = FALSE;
+// Postcondition: samples[] has twice as many entries (or its first 1024),
+//                unless mmap failed, in which case it is unchanged
+// Precondition: the caller holds profile_lock
+
+static void growSamples(void)
+{
+    u_int32_t slots = sample_slots > 0 ? 2 * sample_slots : PROFILE_SLOTS;
+    sample_t *table = mmap(NULL, slots * sizeof(sample_t),
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(table == MAP_FAILED) return;
+
+    u_int32_t i;
+    for(i = 0; i < sample_slots; i++){
+        if(samples[i].arena == 0) continue;
+        u_int32_t j = sampleHash(samples[i].arena, samples[i].offset) & (slots - 1);
+        while(table[j].arena != 0){
+            j = (j + 1) & (slots - 1);
+        }
+        table[j] = samples[i];
     }
-    if(nextRegion->magic != MAGIC_FREE){
-        return FALSE;
+    if(sample_slots > 0){
+        munmap(samples, sample_slots * sizeof(sample_t));
     }
-    return result;
+    samples = table;
+    sample_slots = slots;
+}
+
+// Postcondition: every sample has been dropped
+
+static void clearSamples(void)
+{
+    pthread_mutex_lock(&profile_lock);
+    if(sample_slots > 0){
+        munmap(samples, sample_slots * sizeof(sample_t));
+    }
+    samples = NULL;
+    sample_slots = 0;
+    atomic_store(&sample_count, 0);
+    pthread_mutex_unlock(&profile_lock);
+}
+
+static u_int32_t sampleHash(u_int32_t index, vaddr_t offset)
+{
+    return (offset >> 2) * 2654435761u ^ index * 40503u;
+}
+
+// Input: out - where to write the profile
+// Output: 0, or -1 if there was no memory to sort the samples
+// Postcondition: the live sampled blocks have been written to out in the
+//                legacy pprof heap profile format: one line per call stack
+//                with the estimated # blocks and bytes allocated there,
+//                then the process's memory map so that pprof can find
+//                the symbols, e.g.  pprof --text ./prog heap.prof
+
+int vlad_profile_dump(FILE *out)
+{
+    pthread_mutex_lock(&profile_lock);
+    u_int32_t count = sample_count;
+    size_t bytes = (count > 0 ? count : 1) * sizeof(sample_t);
+    sample_t *sorted = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(sorted == MAP_FAILED){
+        pthread_mutex_unlock(&profile_lock);
+        return -1;
+    }
+    u_int32_t i, n = 0;
+    for(i = 0; i < sample_slots; i++){
+        if(samples[i].arena != 0){
+            sorted[n++] = samples[i];
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+
+    // the same call stack is next to itself once sorted
+    qsort(sorted, n, sizeof(sample_t), compareStacks);
+
+    u_int64_t totalObjects = 0, totalBytes = 0;
+    for(i = 0; i < n; i++){
+        totalObjects += sorted[i].weight;
+        totalBytes += (u_int64_t) sorted[i].weight * sorted[i].size;
+    }
+    fprintf(out, "heap profile: %llu: %llu [%llu: %llu] @ heapprofile\n",
+            (unsigned long long) totalObjects, (unsigned long long) totalBytes,
+            (unsigned long long) totalObjects, (unsigned long long) totalBytes);
+
+    for(i = 0; i < n; ){
+        u_int64_t objects = 0, size = 0;
+        u_int32_t j = i;
+        while(j < n && compareStacks(&sorted[i], &sorted[j]) == 0){
+            objects += sorted[j].weight;
+            size += (u_int64_t) sorted[j].weight * sorted[j].size;
+            j++;
+        }
+        fprintf(out, "%llu: %llu [%llu: %llu] @",
+                (unsigned long long) objects, (unsigned long long) size,
+                (unsigned long long) objects, (unsigned long long) size);
+        u_int32_t k;
+        for(k = 0; k < sorted[i].depth; k++){
+            fprintf(out, " %p", sorted[i].stack[k]);
+        }
+        fprintf(out, "\n");
+        i = j;
+    }
+    munmap(sorted, bytes);
+
+    fprintf(out, "\nMAPPED_LIBRARIES:\n");
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if(maps >= 0){
+        char buffer[4096];
+        ssize_t got;
+        while((got = read(maps, buffer, sizeof(buffer))) > 0){
+            fwrite(buffer, 1, got, out);
+        }
+        close(maps);
+    }
+    fflush(out);
+    return 0;
+}
+
+static int compareStacks(const void *a, const void *b)
+{
+    const sample_t *x = a, *y = b;
+    if(x->depth != y->depth) return x->depth < y->depth ? -1 : 1;
+    return memcmp(x->stack, y->stack, x->depth * sizeof(void *));
 }
 
 // Stop the allocator, so that it can be init'ed again:
@@ -354,17 +3535,184 @@ static u_int32_t adjacent(free_header_t *ptr){
 // ** Complete **
 void vlad_end(void)
 {
-    if(memory == NULL) return;
+    if(leak_report != NULL && num_arenas > 0){
+        reportLeaks(leak_report);
+    }
+
+    stopPurgeThread();
+    atomic_store(&purge_decay, 0);
+
+    u_int32_t i;
+    for(i = 0; i < num_arenas; i++){
+        arena = &arenas[i];
+        munmap(memory - MAP_LEAD, arena->mapped);
+        memory = NULL;
+        atomic_store(&remote_free_head, NO_BLOCK);
+        cache_bytes = 0;
+        cache_budget = 0;
+        dropHandles();
+        dropIndex();
+        dropPageIdle();
+        pthread_mutex_destroy(&arena->lock);
+    }
+    num_arenas = 0;
+    arena = &arenas[0];
+    clearSamples();
+
+    while(huge_list != NULL){
+        freeHuge((byte *) huge_list + HUGE_HEADER_SIZE);
+    }
+    if(huge_slots > 0){
+        munmap(huge_table, huge_slots * sizeof(huge_header_t *));
+    }
+    huge_table = NULL;
+    huge_slots = 0;
+}
+
+// Input: out - where vlad_end is to write its leak report (NULL = none)
+// Postcondition: each later vlad_end lists the blocks that are still
+//                allocated, grouped by size class
+
+void vlad_leak_report(FILE *out)
+{
+    leak_report = out;
+}
+
+// Postcondition: the blocks still allocated in every arena (by pointer
+//                or by handle), and the huge blocks, have been counted by
+//                size class (powers of two, of the whole block or mapping)
+//                and written to out, each class followed by its first
+//                LEAK_LIST blocks and, for a block sampled by vlad_profile,
+//                its call stack
+
+static void reportLeaks(FILE *out)
+{
+    u_int32_t blocks[33] = { 0 };
+    u_int64_t bytes[33] = { 0 };
+    u_int32_t total = 0;
+    u_int64_t totalBytes = 0;
+
+    u_int32_t i;
+    for(i = 0; i < num_arenas; i++){
+        arena = &arenas[i];
+
+        // blocks freed by other threads are not leaks
+        drainRemoteFrees();
+
+        vaddr_t offset = 0;
+        while(offset + ALLOC_HEADER_SIZE <= memory_size){
+            alloc_header_t *block = makeRealPtr(offset);
+            if(!isBlockMagic(block->magic) || block->size < MIN_MEMORY) break;
+            // a handle's block is just as leaked as a pointer's
+            if(block->magic == MAGIC_ALLOC || block->magic == MAGIC_HANDLE){
+                u_int32_t class = sizeClass(block->size);
+                blocks[class]++;
+                bytes[class] += block->size;
+                total++;
+                totalBytes += block->size;
+            }
+            offset += block->size;
+        }
+    }
+
+    huge_header_t *header;
+    for(header = huge_list; header != NULL; header = header->next){
+        // like an arena block's size, the length includes the header
+        u_int32_t class = sizeClass(header->length);
+        blocks[class]++;
+        bytes[class] += header->length;
+        total++;
+        totalBytes += header->length;
+    }
+
+    fprintf(out, "vlad_end: %u blocks (%llu bytes) still allocated\n",
+            total, (unsigned long long) totalBytes);
+    u_int32_t class;
+    for(class = 0; class < 33; class++){
+        if(blocks[class] == 0) continue;
+        fprintf(out, "  %llu-%llu bytes: %u blocks, %llu bytes\n",
+                1ULL << class, (2ULL << class) - 1, blocks[class],
+                (unsigned long long) bytes[class]);
+        listLeaks(out, class);
+        if(blocks[class] > LEAK_LIST){
+            fprintf(out, "    ... and %u more\n", blocks[class] - LEAK_LIST);
+        }
+    }
+    fflush(out);
+}
+
+// Postcondition: the first LEAK_LIST allocated blocks (handle blocks
+//                included) in size class "class" have been written to out
+
+static void listLeaks(FILE *out, u_int32_t class)
+{
+    u_int32_t listed = 0;
+    u_int32_t i;
+    for(i = 0; i < num_arenas && listed < LEAK_LIST; i++){
+        arena = &arenas[i];
+        vaddr_t offset = 0;
+        while(offset + ALLOC_HEADER_SIZE <= memory_size && listed < LEAK_LIST){
+            alloc_header_t *block = makeRealPtr(offset);
+            if(!isBlockMagic(block->magic) || block->size < MIN_MEMORY) break;
+            if((block->magic == MAGIC_ALLOC || block->magic == MAGIC_HANDLE)
+               && sizeClass(block->size) == class){
+                fprintf(out, "    arena %u offset %u size %u", i, offset, block->size);
+                if(block->magic == MAGIC_HANDLE){
+                    fprintf(out, " handle");
+                }
+
+                pthread_mutex_lock(&profile_lock);
+                sample_t *sample = findSample(i + 1, offset);
+                if(sample != NULL){
+                    fprintf(out, " @");
+                    u_int32_t k;
+                    for(k = 0; k < sample->depth; k++){
+                        fprintf(out, " %p", sample->stack[k]);
+                    }
+                }
+                pthread_mutex_unlock(&profile_lock);
+                fprintf(out, "\n");
+                listed++;
+            }
+            offset += block->size;
+        }
+    }
 
-    free(memory);
-    memory = NULL;
+    huge_header_t *header;
+    for(header = huge_list; header != NULL && listed < LEAK_LIST; header = header->next){
+        if(sizeClass(header->length) == class){
+            fprintf(out, "    mmap %p size %llu\n", (byte *) header + HUGE_HEADER_SIZE,
+                    (unsigned long long) header->length);
+            listed++;
+        }
+    }
 }
 
 // Precondition: allocator has been vlad_init()'d
 // Postcondition: allocator stats displayed on stdout
 
 // ** Complete **
-    void vlad_stats(void)
+void vlad_stats(void)
+{
+    u_int32_t i;
+    for(i = 0; i < num_arenas; i++){
+        pthread_mutex_lock(&arenas[i].lock);
+        arena = &arenas[i];
+        statsArena();
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+
+    pthread_mutex_lock(&huge_lock);
+    if(huge_count > 0){
+        printf("Huge blocks: %u  Bytes mapped: %llu\n",
+               huge_count, (unsigned long long) huge_bytes);
+    }
+    pthread_mutex_unlock(&huge_lock);
+}
+
+// Postcondition: stats of the arena being worked on displayed on stdout
+
+static void statsArena(void)
 {
 	// TODO
 	// put whatever code you think will help you
@@ -376,9 +3724,17 @@ void vlad_end(void)
     // I have been given permission by Tony Bao to use this code
     // all credits go to him 
 
-    printf("** Printing Memory **\n ");
+    printf("** Printing Memory (arena %u of %u, NUMA node %d) **\n ",
+           (u_int32_t) (arena - arenas), num_arenas, arena->node);
 	printf("Block starts @ %p\n", memory);
 
+	printf("Splits: %u  Merges: %u  Cache hits: %u  Cached bytes: %u\n",
+	       split_count, merge_count, cache_hits, cache_bytes);
+
+	static const char *policies[] = { "", "best", "worst", "random", "first" };
+	printf("Placement: %s fit%s  Smallest split: %u\n", policies[strategy],
+	       arena->adaptive ? " (adaptive)" : "", arena->split_min);
+
 	byte * cpAddress = memory;
 
 	int i = 0;
@@ -391,6 +3747,213 @@ void vlad_end(void)
 	return;
 }
 
+// Input: report - where to store the results (may be NULL)
+// Output: the number of inconsistencies found
+// Precondition: none
+// Postcondition: memory[] and the free list are unchanged; report holds
+//                block/byte counts and a description of the first error
+//
+// memory[] is walked once from offset 0 to memory_size, checking every
+// header, then the free list is walked once, checking its links and that it
+// holds exactly the free blocks seen in memory[]. Nothing is printed and
+// the program never exits, so it is safe to call periodically.
+
+u_int32_t vlad_check(vlad_report_t *report)
+{
+    vlad_report_t total, local;
+    if(report == NULL) report = &total;
+
+    if(num_arenas == 0){
+        arena = &arenas[0];
+        checkArena(report);
+        return report->errors;
+    }
+
+    // check each arena in turn and add up the results
+    u_int32_t i;
+    for(i = 0; i < num_arenas; i++){
+        pthread_mutex_lock(&arenas[i].lock);
+        arena = &arenas[i];
+        checkArena(i == 0 ? report : &local);
+        pthread_mutex_unlock(&arenas[i].lock);
+
+        if(i == 0) continue;
+        if(local.errors > 0 && report->errors == 0){
+            report->arena = i;
+            report->bad_offset = local.bad_offset;
+            report->message = local.message;
+        }
+        report->errors += local.errors;
+        report->blocks += local.blocks;
+        report->free_blocks += local.free_blocks;
+        report->free_bytes += local.free_bytes;
+        report->alloc_blocks += local.alloc_blocks;
+        report->alloc_bytes += local.alloc_bytes;
+        report->cached_blocks += local.cached_blocks;
+        report->cached_bytes += local.cached_bytes;
+        report->list_blocks += local.list_blocks;
+        report->list_bytes += local.list_bytes;
+        report->index_lost += local.index_lost;
+    }
+    return report->errors;
+}
+
+// Input: report - where to store the results
+// Postcondition: report describes the arena being worked on
+
+static void checkArena(vlad_report_t *report)
+{
+    report->errors = 0;
+    report->arena = arena - arenas;
+    report->bad_offset = 0;
+    report->message = NULL;
+    report->blocks = 0;
+    report->free_blocks = 0;
+    report->free_bytes = 0;
+    report->alloc_blocks = 0;
+    report->alloc_bytes = 0;
+    report->cached_blocks = 0;
+    report->cached_bytes = 0;
+    report->index_lost = arena->index_lost;
+    report->list_blocks = 0;
+    report->list_bytes = 0;
+
+    if(memory == NULL){
+        reportError(report, 0, "allocator not initialised");
+        return;
+    }
+
+    // walk the physical block chain
+    // a bad magic or size means we cannot find the next header, so stop there
+    vaddr_t offset = 0;
+    int prevFree = FALSE;
+    while(offset < memory_size){
+        alloc_header_t *block = makeRealPtr(offset);
+
+        if(!isBlockMagic(block->magic)){
+            reportError(report, offset, "bad magic number in block header");
+            break;
+        }
+        if(block->size < MIN_MEMORY || block->size % 4 != 0
+           || block->size > memory_size - offset){
+            reportError(report, offset, "bad block size");
+            break;
+        }
+
+        report->blocks++;
+        if(block->magic == MAGIC_FREE){
+            if(prevFree){
+                reportError(report, offset, "adjacent free blocks not merged");
+            }
+            report->free_blocks++;
+            report->free_bytes += block->size;
+            prevFree = TRUE;
+        } else if(block->magic == MAGIC_CACHED){
+            report->cached_blocks++;
+            report->cached_bytes += block->size;
+            prevFree = FALSE;
+        } else {
+            report->alloc_blocks++;
+            report->alloc_bytes += block->size;
+            prevFree = FALSE;
+        }
+        offset += block->size;
+    }
+
+    // walk the free list
+    // it can never be longer than the number of free blocks, so a longer
+    // walk means the list does not lead back to free_list_ptr
+    if(report->free_blocks > 0){
+        vaddr_t curr = free_list_ptr;
+        do{
+            if(curr % 4 != 0 || curr > memory_size - FREE_HEADER_SIZE){
+                reportError(report, curr, "free list link out of range");
+                break;
+            }
+            free_header_t *node = makeRealPtr(curr);
+            if(node->magic != MAGIC_FREE){
+                reportError(report, curr, "free list holds a non-free block");
+                break;
+            }
+            if(node->next % 4 != 0 || node->next > memory_size - FREE_HEADER_SIZE){
+                reportError(report, curr, "free list link out of range");
+                break;
+            }
+            free_header_t *next = makeRealPtr(node->next);
+            if(next->prev != curr){
+                reportError(report, curr, "free list next->prev mismatch");
+            }
+            report->list_blocks++;
+            report->list_bytes += node->size;
+            if(report->list_blocks > report->free_blocks){
+                reportError(report, curr, "free list does not return to its start");
+                break;
+            }
+            curr = node->next;
+        } while(curr != free_list_ptr);
+    }
+
+    if(report->list_blocks != report->free_blocks
+       || report->list_bytes != report->free_bytes){
+        reportError(report, free_list_ptr, "free list does not cover every free block");
+    }
+
+    // the victim, if any, must be a free block
+    if(arena->victim != NO_BLOCK
+       && (arena->victim % 4 != 0 || arena->victim > memory_size - FREE_HEADER_SIZE
+           || ((free_header_t *) makeRealPtr(arena->victim))->magic != MAGIC_FREE)){
+        reportError(report, arena->victim, "last remainder is not a free block");
+    }
+
+    // check the free-list index, if there is one
+    // every entry must be a free block of the size given, one per block
+    if(arena->index_sizes != NULL){
+        if(arena->index_count != report->free_blocks){
+            reportError(report, 0, "free-list index does not cover every free block");
+        }
+        u_int32_t i;
+        for(i = 0; i < arena->index_count; i++){
+            vaddr_t curr = arena->index_offsets[i];
+            free_header_t *node = makeRealPtr(curr);
+            if(curr % 4 != 0 || curr > memory_size - FREE_HEADER_SIZE
+               || node->magic != MAGIC_FREE || node->size != arena->index_sizes[i]){
+                reportError(report, curr, "bad entry in free-list index");
+                break;
+            }
+            if(indexFind(curr) != (int) i){
+                reportError(report, curr, "free-list index entry not found by its offset");
+                break;
+            }
+        }
+    }
+
+    // walk the quick-reuse cache
+    // every block in a bin must be cached and of that bin's size
+    u_int32_t cachedBlocks = 0;
+    vsize_t cachedBytes = 0;
+    int bin;
+    for(bin = 0; bin < CACHE_BINS; bin++){
+        vaddr_t curr = cache_bin[bin];
+        while(curr != NO_BLOCK){
+            alloc_header_t *block = makeRealPtr(curr);
+            if(curr % 4 != 0 || curr > memory_size - MIN_MEMORY
+               || block->magic != MAGIC_CACHED
+               || block->size != MIN_MEMORY + 4 * bin){
+                reportError(report, curr, "bad block in quick-reuse cache");
+                break;
+            }
+            cachedBlocks++;
+            cachedBytes += block->size;
+            if(cachedBlocks > report->cached_blocks) break;
+            curr = *cacheLink(block);
+        }
+    }
+    if(cachedBlocks != report->cached_blocks || cachedBytes != cache_bytes
+       || cachedBytes != report->cached_bytes){
+        reportError(report, 0, "quick-reuse cache does not cover every cached block");
+    }
+}
+
 // My functions - To make things easier
 
 // returns the smallest power of two which is larger than the input size
@@ -427,26 +3990,217 @@ static vsize_t powerOfTwo(vsize_t size){
     return idealSize;
 }
 
-// returns the smallest power of four which is larger or equal to n
+// returns the smallest multiple of four which is larger or equal to n
+// (and at least MIN_MEMORY); n near 2^32 gives the largest multiple of four
 
 // ** Complete **
 static vsize_t multipleOfFour(vsize_t n){
 
-    int input = n;
+    if(n < MIN_MEMORY){
+        return MIN_MEMORY;
+    }
+
+    if(n > (vsize_t) -4){
+        return (vsize_t) -4;
+    }
+
+    return (n + 3) & ~(vsize_t) 3;
+}
+
+// Input: n - number of bytes requested
+// Output: size of the block that holds them: n plus the header, rounded
+//         up as by multipleOfFour and then to a multiple of granule
+// Precondition: n <= MAX_REQUEST, so that the block size is representable
+//               (larger n give the largest multiple of granule, which no
+//               arena can hold)
 
-    if(input % 4 == 0 && input >= MIN_MEMORY){
-        return input;
+static vsize_t blockSize(vsize_t n)
+{
+    if(n > MAX_REQUEST){
+        return (vsize_t) -1 & ~(granule - 1);
     }
+    vsize_t size = multipleOfFour(n + ALLOC_HEADER_SIZE);
+    return (size + granule - 1) & ~(granule - 1);
+}
 
-    if(input < MIN_MEMORY){
-        return MIN_MEMORY;
+// Input: out - stream to write to, format - VLAD_MAP_CSV or VLAD_MAP_JSON
+// Output: 0 on success, -1 if the allocator is not initialised or a
+//         corrupt header stops the walk
+// Precondition: none
+// Postcondition: a map of memory[] has been written to out
+//
+// Consecutive blocks in the same state are written as a single run
+// (offset, total size, # blocks), so the map grows with the number of
+// free/allocated transitions rather than with memory_size. It is followed
+// by the free block sizes grouped into power-of-two classes, the largest
+// free block and the external fragmentation index
+// (1 - largest free block / total free bytes).
+
+int vlad_map(FILE *out, int format)
+{
+    int result = 0;
+
+    if(num_arenas == 0) return -1;
+
+    // one map per arena, each with its own summary
+    u_int32_t i;
+    for(i = 0; i < num_arenas; i++){
+        pthread_mutex_lock(&arenas[i].lock);
+        arena = &arenas[i];
+        if(mapArena(out, format, i) != 0){
+            result = -1;
+        }
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    return result;
+}
+
+// Input: out, format - as for vlad_map; index - number of the arena
+// Output: as for vlad_map, for the arena being worked on
+
+static int mapArena(FILE *out, int format, u_int32_t index)
+{
+    u_int32_t classCount[32] = {0};
+    u_int32_t classBytes[32] = {0};
+    vsize_t freeBytes = 0, largest = 0;
+    u_int32_t freeBlocks = 0;
+    int result = 0;
+
+    if(memory == NULL) return -1;
+
+    if(format == VLAD_MAP_JSON){
+        fprintf(out, "{\"arena\":%u,\"node\":%d,\"memory_size\":%u,\"runs\":[",
+                index, arena->node, memory_size);
+    } else {
+        fprintf(out, "# arena %u (NUMA node %d) runs\nstate,offset,size,blocks\n",
+                index, arena->node);
+    }
+
+    vaddr_t offset = 0, runStart = 0;
+    vsize_t runSize = 0;
+    u_int32_t runBlocks = 0;
+    int runFree = FALSE, firstRun = TRUE;
+    while(offset < memory_size){
+        alloc_header_t *block = makeRealPtr(offset);
+
+        if(!isBlockMagic(block->magic)
+           || block->size < MIN_MEMORY || block->size > memory_size - offset){
+            result = -1;
+            break;
+        }
+
+        int isFree = (block->magic == MAGIC_FREE);
+        if(runBlocks > 0 && isFree != runFree){
+            printRun(out, format, firstRun, runFree, runStart, runSize, runBlocks);
+            firstRun = FALSE;
+            runBlocks = 0;
+        }
+        if(runBlocks == 0){
+            runStart = offset;
+            runSize = 0;
+            runFree = isFree;
+        }
+        runSize += block->size;
+        runBlocks++;
+
+        if(isFree){
+            u_int32_t class = sizeClass(block->size);
+            classCount[class]++;
+            classBytes[class] += block->size;
+            freeBytes += block->size;
+            freeBlocks++;
+            if(block->size > largest) largest = block->size;
+        }
+        offset += block->size;
+    }
+    if(runBlocks > 0){
+        printRun(out, format, firstRun, runFree, runStart, runSize, runBlocks);
+    }
+
+    double fragmentation = 0.0;
+    if(freeBytes > 0){
+        fragmentation = 1.0 - (double) largest / freeBytes;
+    }
+
+    if(format == VLAD_MAP_JSON){
+        fprintf(out, "],\"free_sizes\":[");
+    } else {
+        fprintf(out, "# free block sizes\nmin_size,max_size,count,bytes\n");
+    }
+    int firstClass = TRUE;
+    u_int32_t class;
+    for(class = 0; class < 32; class++){
+        if(classCount[class] == 0) continue;
+        u_int32_t low = 1u << class;
+        u_int32_t high = low + (low - 1);
+        if(format == VLAD_MAP_JSON){
+            fprintf(out, "%s{\"min\":%u,\"max\":%u,\"count\":%u,\"bytes\":%u}",
+                    firstClass ? "" : ",", low, high,
+                    classCount[class], classBytes[class]);
+        } else {
+            fprintf(out, "%u,%u,%u,%u\n", low, high,
+                    classCount[class], classBytes[class]);
+        }
+        firstClass = FALSE;
+    }
+
+    if(format == VLAD_MAP_JSON){
+        fprintf(out, "],\"free_blocks\":%u,\"free_bytes\":%u,"
+                "\"largest_free\":%u,\"fragmentation\":%.4f,\"complete\":%s}\n",
+                freeBlocks, freeBytes, largest, fragmentation,
+                result == 0 ? "true" : "false");
+    } else {
+        fprintf(out, "# summary\nfree_blocks,free_bytes,largest_free,fragmentation,complete\n"
+                "%u,%u,%u,%.4f,%d\n",
+                freeBlocks, freeBytes, largest, fragmentation, result == 0);
+    }
+    return result;
+}
+
+// write one run of same-state blocks for vlad_map()
+
+static void printRun(FILE *out, int format, int first, int isFree,
+                     vaddr_t offset, vsize_t size, u_int32_t blocks){
+
+    if(format == VLAD_MAP_JSON){
+        fprintf(out, "%s{\"state\":\"%s\",\"offset\":%u,\"size\":%u,\"blocks\":%u}",
+                first ? "" : ",", isFree ? "free" : "alloc", offset, size, blocks);
+    } else {
+        fprintf(out, "%s,%u,%u,%u\n", isFree ? "free" : "alloc", offset, size, blocks);
+    }
+}
+
+// returns the power-of-two size class of a block, i.e. floor(log2(size))
+// (a huge block's mapping may be 2^32 bytes or more)
+
+static u_int32_t sizeClass(u_int64_t size){
+
+    u_int32_t class = 0;
+    while(size > 1){
+        size = size / 2;
+        class++;
     }
+    return class;
+}
+
+// record an error found by vlad_check()
+// only the first error's offset and description are kept
 
-    while(input % 4 != 0){
-        input++;
+static void reportError(vlad_report_t *report, vaddr_t offset, const char *message){
+
+    if(report->errors == 0){
+        report->bad_offset = offset;
+        report->message = message;
     }
+    report->errors++;
+}
+
+// returns TRUE if magic is one of the values a block header may hold
+
+static int isBlockMagic(u_int32_t magic){
 
-    return input;
+    return magic == MAGIC_FREE || magic == MAGIC_ALLOC || magic == MAGIC_CACHED
+        || magic == MAGIC_HANDLE || magic == MAGIC_QUEUED;
 }
 
 // To convert a vaddr_t value to a real C pointer
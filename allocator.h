@@ -11,23 +11,208 @@
 #define ALLOCATOR_H
 
 #include <stdlib.h>
+#include <stdio.h>
 
 // Solves unknown type uint32_t problem
 #include <sys/types.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // Allocate "size" bytes to be used by the sub-allocator
 void vlad_init(u_int32_t size);
 
+// Allocate n arenas of "size" bytes each (n = 0: one per CPU core), so that
+// threads allocating at the same time mostly use different arenas
+void vlad_init_arenas(u_int32_t size, u_int32_t n);
+
+// As vlad_init_arenas, but return -1 (with nothing set up) rather than
+// exit if the memory cannot be had; 0 = OK
+int vlad_try_init_arenas(u_int32_t size, u_int32_t n);
+
+// Allocate an arena of "size" bytes on each NUMA node; threads allocate
+// from the arena on their own node (a single arena without NUMA)
+void vlad_init_numa(u_int32_t size);
+
+// Make every block a multiple of "granule" bytes (4, the default, 8 or 16)
+// so that each pointer vlad_malloc returns is aligned to it, as a general
+// purpose malloc's must be. Only while Vlad is not initialised; returns 0,
+// or -1 if granule is not one of those or Vlad is running
+int vlad_set_granule(u_int32_t granule);
+
 // Allocate a chunk of memory with size >= n, if one is available
 void *vlad_malloc(u_int32_t n);
 
+// Allocate a zeroed chunk of memory for nmemb elements of "size" bytes
+void *vlad_calloc(u_int32_t nmemb, u_int32_t size);
+
+// Resize a chunk of allocated memory, moving it only if it cannot grow
+void *vlad_realloc(void *object, u_int32_t n);
+
+// Allocate a chunk of memory with size >= n at a multiple of "alignment"
+// (a power of two)
+void *vlad_aligned_alloc(u_int32_t alignment, u_int32_t n);
+
+// As vlad_aligned_alloc, but only from arena "index" (see vlad_init_arenas)
+void *vlad_arena_alloc(u_int32_t index, u_int32_t alignment, u_int32_t n);
+
+// Lifetime hints for vlad_malloc_hint()
+#define VLAD_SHORT      1
+#define VLAD_LONG       2
+#define VLAD_PERMANENT  3
+
+// As vlad_malloc, but placed by expected lifetime: short-lived blocks from
+// the low end of the arena, long-lived and permanent ones from the high end
+void *vlad_malloc_hint(u_int32_t n, int lifetime);
+
+// Whether "object" points into memory managed by Vlad
+int vlad_owns(void *object);
+
+// Number of bytes usable at "object" (may be more than were requested)
+u_int32_t vlad_usable_size(void *object);
+
+// Usable size that a request for n bytes is rounded up to (never less
+// than n), or 0 if n is too big for any block
+u_int32_t vlad_good_size(u_int32_t n);
+
 // Release chunk of allocated memory and return to free list for re-ue
 void vlad_free(void *object);
 
+// Release chunk allocated by vlad_malloc(n), when the caller knows n
+void vlad_free_sized(void *object, u_int32_t n);
+
+// Release chunk of allocated memory from a thread other than the one using
+// the allocator; it is reclaimed by that thread's next vlad_malloc
+void vlad_free_remote(void *object);
+
+// Handle for a block that vlad_compact() may move (0 = no block)
+typedef u_int32_t vlad_handle_t;
+
+// Allocate n bytes that are reached through a handle rather than a pointer
+vlad_handle_t vlad_handle_alloc(u_int32_t n);
+
+// Current address of a handle's block (changes when memory is compacted)
+void *vlad_handle_get(vlad_handle_t handle);
+
+// Release the block behind a handle
+void vlad_handle_free(vlad_handle_t handle);
+
+// Slide handle blocks toward offset 0 so free space is merged into fewer,
+// larger blocks; returns the number of bytes moved
+u_int32_t vlad_compact(void);
+
+// As vlad_compact, but stop after moving about "budget" bytes
+u_int32_t vlad_compact_step(u_int32_t budget);
+
+// Saved copy of the allocator's state
+typedef struct vlad_snapshot vlad_snapshot_t;
+
+// Save the whole allocator (NULL if out of memory)
+vlad_snapshot_t *vlad_snapshot(void);
+
+// Put the allocator back as it was when "snapshot" was taken (0 = OK)
+int vlad_restore(vlad_snapshot_t *snapshot);
+
+// Release a snapshot
+void vlad_snapshot_free(vlad_snapshot_t *snapshot);
+
+// Give each request for n bytes or more its own mmap, unmapped when it is
+// freed and grown by vlad_realloc with mremap (0 = never, the default)
+void vlad_set_mmap_threshold(u_int32_t n);
+
+// Hold up to "budget" bytes of freed blocks for quick reuse, merging them
+// only when needed (0 = merge on every free, the default)
+void vlad_set_lazy(u_int32_t budget);
+
+// Placement policies for vlad_set_policy()
+#define VLAD_BEST_FIT    1
+#define VLAD_WORST_FIT   2
+#define VLAD_RANDOM_FIT  3
+#define VLAD_FIRST_FIT   4
+#define VLAD_ADAPTIVE    5
+
+// Place blocks by "policy" (VLAD_BEST_FIT by default), splitting a free
+// block only if "split" bytes or more would be left over (default 32).
+// With VLAD_ADAPTIVE, each arena switches between best and first fit,
+// and moves its split threshold between "split" and "split_max", from
+// the fragmentation, search lengths and failures it sees. Returns 0, or
+// -1 if policy is unknown, split < 16 or split_max < split (adaptive)
+int vlad_set_policy(int policy, u_int32_t split, u_int32_t split_max);
+
+// Carve each request of up to "max" bytes made straight after another
+// from what that one's split left over, instead of searching for a best
+// fit (0 = always search, the default)
+void vlad_set_victim(u_int32_t max);
+
+// Keep (on = 1) or drop (on = 0) a dense index of each arena's free
+// blocks, which vlad_malloc searches instead of the free list; returns 0,
+// or -1 if out of memory (the index is then off)
+int vlad_set_index(int on);
+
+// Give the pages inside free blocks back to the OS (MADV_DONTNEED) once
+// they have gone unused for "decay" ms (0 = never, the default): every
+// "interval" ms from a background thread, or only when vlad_purge is
+// called (interval = 0). Returns 0, or -1 if out of memory or the thread
+// could not be started (pages are then never given back)
+int vlad_set_decay(u_int32_t decay, u_int32_t interval);
+
+// Give back about "budget" bytes of pages idle for the vlad_set_decay
+// time; returns the number of bytes given back
+u_int32_t vlad_purge(u_int32_t budget);
+
+// Record the call stack of about one allocation per "rate" bytes
+// (0 = stop); the blocks sampled are kept track of until freed
+void vlad_profile(u_int32_t rate);
+
+// Write live sampled allocations by call stack to "out" in pprof's heap
+// profile format; returns 0, or -1 if out of memory
+int vlad_profile_dump(FILE *out);
+
+// Have vlad_end list the blocks still allocated, by size class, on "out"
+// (NULL = no report, the default)
+void vlad_leak_report(FILE *out);
+
 // Stop the allocator, so that it can be init'ed again:
 void vlad_end(void);
 
 // Function to display details of memory layout (for debugging)
 void vlad_stats(void);
 
+// Summary of the heap produced by vlad_check()
+typedef struct vlad_report {
+    u_int32_t errors;        // # inconsistencies found (0 means heap is OK)
+    u_int32_t arena;         // arena where the first error was seen
+    u_int32_t bad_offset;    // memory[] index where the first error was seen
+    const char *message;     // description of the first error (or NULL)
+    u_int32_t blocks;        // # blocks seen walking memory[] from offset 0
+    u_int32_t free_blocks;   // # of those blocks marked MAGIC_FREE
+    u_int32_t free_bytes;    // total size of those free blocks
+    u_int32_t alloc_blocks;  // # of those blocks allocated (or queued by
+                             // vlad_free_remote but not yet reclaimed)
+    u_int32_t alloc_bytes;   // total size of those allocated blocks
+    u_int32_t cached_blocks; // # blocks held for reuse by vlad_set_lazy()
+    u_int32_t cached_bytes;  // total size of those cached blocks
+    u_int32_t list_blocks;   // # blocks reached by walking the free list
+    u_int32_t list_bytes;    // total size of the blocks on the free list
+    u_int32_t index_lost;    // # times a free-list index (vlad_set_index)
+                             // was dropped for lack of memory
+} vlad_report_t;
+
+// Check the consistency of the heap (for each arena, one walk over memory[]
+// and one over the free list) and fill in *report; returns # errors
+u_int32_t vlad_check(vlad_report_t *report);
+
+// Output formats for vlad_map()
+#define VLAD_MAP_CSV   1
+#define VLAD_MAP_JSON  2
+
+// Write a run-length map (for each arena) of allocated/free blocks and a fragmentation
+// summary to "out"; returns 0, or -1 if the heap cannot be walked
+int vlad_map(FILE *out, int format);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,128 @@
+//
+//  Vlad: the memory allocator
+//  allocator.hpp ... C++ adapters (std::pmr and STL allocators)
+//
+//  Compile allocator.c as C and link it in, e.g.
+//      gcc -c allocator.c && g++ -std=c++17 prog.cpp allocator.o -pthread
+//
+
+#ifndef ALLOCATOR_HPP
+#define ALLOCATOR_HPP
+
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+
+#include "allocator.h"
+
+namespace vlad {
+
+// Any arena (the thread's home arena first), as for vlad_malloc
+constexpr int any_arena = -1;
+
+// Input: arena - an index as for vlad_arena_alloc, or any_arena
+// Output: n bytes aligned to "alignment"; throws std::bad_alloc if there
+//         is no room, or if no block can hold n bytes (Vlad's requests
+//         are at most 32 bits, and a block's size includes its header)
+
+inline void *allocate(int arena, std::size_t n, std::size_t alignment)
+{
+    void *object = nullptr;
+    if (n <= std::numeric_limits<u_int32_t>::max()
+        && alignment <= std::numeric_limits<u_int32_t>::max()) {
+        object = (arena == any_arena)
+                 ? vlad_aligned_alloc(alignment, n)
+                 : vlad_arena_alloc(arena, alignment, n);
+    }
+    if (object == nullptr) throw std::bad_alloc();
+    return object;
+}
+
+// The size is always known here, so it goes straight to vlad_free_sized
+
+inline void deallocate(void *object, std::size_t n)
+{
+    vlad_free_sized(object, n);
+}
+
+// A std::pmr::memory_resource over Vlad, e.g.
+//     vlad::arena_resource arena0(0);
+//     std::pmr::vector<int> v(&arena0);
+
+class arena_resource : public std::pmr::memory_resource {
+public:
+    explicit arena_resource(int arena = any_arena) noexcept : arena_(arena) {}
+
+    int arena() const noexcept { return arena_; }
+
+private:
+    void *do_allocate(std::size_t n, std::size_t alignment) override
+    {
+        return vlad::allocate(arena_, n, alignment);
+    }
+
+    void do_deallocate(void *object, std::size_t n, std::size_t) override
+    {
+        vlad::deallocate(object, n);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        // any resource over Vlad can free blocks from any arena
+        return dynamic_cast<const arena_resource *>(&other) != nullptr;
+    }
+
+    int arena_;
+};
+
+// An STL allocator over Vlad, e.g.
+//     std::vector<int, vlad::allocator<int>> v(vlad::allocator<int>(0));
+
+template <class T>
+class allocator {
+public:
+    using value_type = T;
+
+    allocator() noexcept : arena_(any_arena) {}
+    explicit allocator(int arena) noexcept : arena_(arena) {}
+
+    template <class U>
+    allocator(const allocator<U> &other) noexcept : arena_(other.arena()) {}
+
+    T *allocate(std::size_t n)
+    {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        return static_cast<T *>(vlad::allocate(arena_, n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *object, std::size_t n) noexcept
+    {
+        vlad::deallocate(object, n * sizeof(T));
+    }
+
+    int arena() const noexcept { return arena_; }
+
+private:
+    int arena_;
+};
+
+// Blocks can be freed through any allocator over Vlad, whatever its arena
+
+template <class T, class U>
+bool operator==(const allocator<T> &, const allocator<U> &) noexcept
+{
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const allocator<T> &, const allocator<U> &) noexcept
+{
+    return false;
+}
+
+} // namespace vlad
+
+#endif
@@ -0,0 +1,599 @@
+// gcc -Wall -Werror -O2 -pthread -o benchVlad benchVlad.c
+// Benchmarks for allocator.c
+// Like the unit tests, this includes allocator.c directly so that it can
+// read Vlad's internal counters. Run with no arguments.
+// The hardware counters at the end come from perf_event_open(2), which
+// needs a CPU with a PMU (not most VMs) and perf_event_paranoid <= 2;
+// counters that cannot be opened are shown as "-". That code has never
+// been run on a PMU, only where there is none (every counter shows "-")
+// and with software events put in for the hardware ones, so its numbers
+// have not been checked against perf stat.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#include "allocator.h"
+#include "allocator.c"
+
+#define BENCH_MEMORY  (1 << 20)
+#define BENCH_LIVE    256
+#define BENCH_OPS     200000
+#define BURST         16          // objects allocated together, then freed
+#define ROUNDS        200         // rounds of runLifetimes
+#define THREAD_LIVE   64
+#define THREAD_OPS    50000
+#define MAX_THREADS   64
+#define SEARCH_WORK   (1 << 24)   // index entries read per kernel and length
+#define SEARCH_MAX    (1 << 20)
+#define SPIKE_MEMORY  (64 << 20)
+#define SPIKE_BLOCKS  512         // 64KB blocks allocated, touched and freed
+#define SPIKE_SIZE    (64 << 10)
+#define DECAY         10          // ms, for vlad_set_decay
+#define BATCH         (BENCH_LIVE / 4)  // objects freed, then reallocated, per count
+#define COUNTERS      6
+#define NO_GROUP      (-1)
+#define CACHE_MISS(cache) ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) \
+                           | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+typedef struct workload {
+   const char *name;
+   u_int32_t (*nextSize)(u_int32_t slot, u_int32_t oldSize);
+} workload_t;
+
+static u_int32_t sameSize(u_int32_t slot, u_int32_t oldSize);
+static u_int32_t mixedSize(u_int32_t slot, u_int32_t oldSize);
+static void runChurn(workload_t *w, u_int32_t budget, int index);
+static void runBursts(u_int32_t victim);
+static void runLifetimes(int hinted);
+static void runPurge(int background);
+static double residentKB(void);
+static void runThreads(u_int32_t threads, u_int32_t numArenas);
+static void runSearch(u_int32_t count);
+static double timeSearch(int (*search)(const vsize_t *, u_int32_t, vsize_t),
+                         const vsize_t *sizes, u_int32_t count, u_int32_t *check);
+static void *threadChurn(void *arg);
+static double now(void);
+
+typedef struct counter {
+   const char *name;
+   u_int32_t type;
+   u_int64_t config;
+   int fd;                        // -1 if the counter could not be opened
+   int slot;                      // its place in the group's read
+} counter_t;
+
+typedef struct engine {
+   const char *name;
+   u_int32_t budget;              // for vlad_set_lazy
+   int index;                     // for vlad_set_index
+} engine_t;
+
+static int openCounters(void);
+static void closeCounters(void);
+static void countOn(void);
+static void countOff(void);
+static void readCounters(double *values);
+static void runCounters(workload_t *w, engine_t *e);
+static void printCounts(workload_t *w, engine_t *e, const char *op,
+                        double *values, u_int32_t ops);
+
+// the counters that could be opened form one group, led by the first
+static int leader = NO_GROUP;
+static int members;
+
+static counter_t counters[COUNTERS] = {
+   { "cycles",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1 },
+   { "instrs",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1 },
+   { "L1d miss",  PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_L1D), -1 },
+   { "LLC miss",  PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_LL), -1 },
+   { "dTLB miss", PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB), -1 },
+   { "br miss",   PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1 },
+};
+
+static engine_t engines[] = {
+   { "list",  0,     0 },
+   { "index", 0,     1 },
+   { "lazy",  65536, 0 },
+};
+
+static workload_t workloads[] = {
+   { "same-size churn", sameSize },
+   { "mixed churn",     mixedSize },
+};
+
+int main(int argc, char *argv[])
+{
+   u_int32_t budgets[] = { 0, 4096, 65536 };
+   int w, b, index;
+
+   printf("%-16s %8s %6s %12s %9s %9s %11s\n", "workload", "budget",
+          "index", "ops/sec", "splits", "merges", "cache hits");
+   for (w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+      for (b = 0; b < sizeof(budgets) / sizeof(budgets[0]); b++) {
+         for (index = 0; index <= 1; index++) {
+            runChurn(&workloads[w], budgets[b], index);
+         }
+      }
+   }
+
+   printf("\n%-16s %8s %12s %11s\n", "bursts", "victim", "ops/sec", "contiguous");
+   runBursts(0);
+   runBursts(256);
+
+   printf("\n%-16s %8s %12s %11s\n", "lifetimes", "hints", "free blocks", "largest");
+   runLifetimes(0);
+   runLifetimes(1);
+
+   printf("\n%-16s %8s %12s %11s\n", "after a spike", "purge", "ops/sec", "resident");
+   runPurge(0);
+   runPurge(1);
+
+   u_int32_t threads;
+   printf("\n%-8s %14s %14s\n", "threads", "1 arena", "1 per thread");
+   for (threads = 1; threads <= MAX_THREADS; threads *= 2) {
+      printf("%-8u", threads);
+      runThreads(threads, 1);
+      runThreads(threads, threads);
+      printf("\n");
+   }
+
+   u_int32_t count;
+   printf("\n%-8s %10s %10s %10s   (ns per best-fit search)\n",
+          "entries", "scalar", "sse4.1", "avx2");
+   for (count = 10; count <= SEARCH_MAX; count *= 10) {
+      runSearch(count);
+   }
+
+   int e, c;
+   printf("\n%-16s %-6s %-6s", "per operation", "engine", "op");
+   for (c = 0; c < COUNTERS; c++) {
+      printf(" %9s", counters[c].name);
+   }
+   printf("\n");
+   if (openCounters() > 0) {
+      for (w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+         for (e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+            runCounters(&workloads[w], &engines[e]);
+         }
+      }
+   }
+   closeCounters();
+   return EXIT_SUCCESS;
+}
+
+// a freed object is replaced by one of the same size
+static u_int32_t sameSize(u_int32_t slot, u_int32_t oldSize)
+{
+   return oldSize != 0 ? oldSize : 8 + 8 * (slot % 16);
+}
+
+// a freed object is replaced by one of any size up to 256 bytes
+static u_int32_t mixedSize(u_int32_t slot, u_int32_t oldSize)
+{
+   return 1 + rand() % 256;
+}
+
+// keep BENCH_LIVE objects live, repeatedly freeing a random one and
+// allocating its replacement, and report the split/merge work done
+// (with or without the free-list index)
+static void runChurn(workload_t *w, u_int32_t budget, int index)
+{
+   void *ptr[BENCH_LIVE];
+   u_int32_t size[BENCH_LIVE];
+   u_int32_t i;
+
+   srand(1927);
+   vlad_init(BENCH_MEMORY);
+   vlad_set_lazy(budget);
+   vlad_set_index(index);
+   for (i = 0; i < BENCH_LIVE; i++) {
+      size[i] = w->nextSize(i, 0);
+      ptr[i] = vlad_malloc(size[i]);
+   }
+   u_int32_t splits = split_count, merges = merge_count, hits = cache_hits;
+
+   double start = now();
+   for (i = 0; i < BENCH_OPS; i++) {
+      u_int32_t slot = rand() % BENCH_LIVE;
+      if (ptr[slot] != NULL) vlad_free(ptr[slot]);
+      size[slot] = w->nextSize(slot, size[slot]);
+      ptr[slot] = vlad_malloc(size[slot]);
+   }
+   double elapsed = now() - start;
+
+   printf("%-16s %8u %6s %12.0f %9u %9u %11u\n", w->name, budget,
+          index ? "on" : "off", 2 * BENCH_OPS / elapsed, split_count - splits,
+          merge_count - merges, cache_hits - hits);
+   vlad_end();
+}
+
+// on a heap left with BENCH_LIVE holes too small to use, repeatedly
+// allocate BURST objects of 32-128 bytes and then free them; reports how
+// often an object starts where the one allocated just before it ends
+static void runBursts(u_int32_t victim)
+{
+   byte *ptr[2 * BENCH_LIVE];
+   byte *burst[BURST];
+   u_int32_t i, b;
+
+   srand(1927);
+   vlad_init(BENCH_MEMORY);
+   vlad_set_victim(victim);
+   for (i = 0; i < 2 * BENCH_LIVE; i++) {
+      ptr[i] = vlad_malloc((i % 2 == 0) ? 1 + rand() % 16 : 1 + rand() % 128);
+   }
+   for (i = 0; i < 2 * BENCH_LIVE; i += 2) {
+      vlad_free(ptr[i]);
+   }
+
+   u_int32_t contiguous = 0;
+   double start = now();
+   for (i = 0; i < BENCH_OPS / BURST; i++) {
+      for (b = 0; b < BURST; b++) {
+         burst[b] = vlad_malloc(32 + rand() % 97);
+         if (b > 0 && burst[b] == burst[b - 1]
+             + ((alloc_header_t *) (burst[b - 1] - ALLOC_HEADER_SIZE))->size) {
+            contiguous++;
+         }
+      }
+      for (b = 0; b < BURST; b++) {
+         vlad_free(burst[b]);
+      }
+   }
+   double elapsed = now() - start;
+
+   printf("%-16s %8u %12.0f %10.0f%%\n", "small bursts", victim,
+          2.0 * (BENCH_OPS / BURST) * BURST / elapsed,
+          100.0 * contiguous / ((BENCH_OPS / BURST) * (BURST - 1)));
+   for (i = 1; i < 2 * BENCH_LIVE; i += 2) {
+      vlad_free(ptr[i]);
+   }
+   vlad_end();
+}
+
+// each round allocates BENCH_LIVE short-lived objects with one long-lived
+// object among them, then frees the short-lived ones; reports how broken
+// up the free space is at the end
+static void runLifetimes(int hinted)
+{
+   void *ptr[BENCH_LIVE];
+   u_int32_t i, r;
+
+   srand(1927);
+   vlad_init(BENCH_MEMORY);
+   for (r = 0; r < ROUNDS; r++) {
+      u_int32_t keep = rand() % BENCH_LIVE;
+      for (i = 0; i < BENCH_LIVE; i++) {
+         u_int32_t n = 1 + rand() % 256;
+         if (i != keep) {
+            ptr[i] = hinted ? vlad_malloc_hint(n, VLAD_SHORT) : vlad_malloc(n);
+         } else if (hinted) {
+            vlad_malloc_hint(n, VLAD_LONG);
+         } else {
+            vlad_malloc(n);
+         }
+      }
+      for (i = 0; i < BENCH_LIVE; i++) {
+         if (i != keep) vlad_free(ptr[i]);
+      }
+   }
+
+   vlad_report_t report;
+   vlad_check(&report);
+   vsize_t largest = 0;
+   vaddr_t curr = free_list_ptr;
+   do {
+      free_header_t *block = makeRealPtr(curr);
+      if (block->size > largest) largest = block->size;
+      curr = block->next;
+   } while (curr != free_list_ptr);
+
+   printf("%-16s %8s %12u %11u\n", "short + long", hinted ? "on" : "off",
+          report.free_blocks, largest);
+   vlad_end();
+}
+
+// a spike of SPIKE_BLOCKS large blocks is allocated, written and freed,
+// then BENCH_LIVE small objects churn as in runChurn; reports how fast
+// the churn ran and how much of memory[] is resident at the end (with
+// or without a thread giving idle pages back)
+static void runPurge(int background)
+{
+   void *ptr[SPIKE_BLOCKS] = { NULL };
+   u_int32_t i;
+
+   srand(1927);
+   vlad_init(SPIKE_MEMORY);
+   if (background) vlad_set_decay(DECAY, DECAY);
+   for (i = 0; i < SPIKE_BLOCKS; i++) {
+      ptr[i] = vlad_malloc(SPIKE_SIZE);
+      memset(ptr[i], 1, SPIKE_SIZE);
+   }
+   for (i = 0; i < SPIKE_BLOCKS; i++) {
+      vlad_free(ptr[i]);
+      ptr[i] = NULL;
+   }
+
+   double start = now();
+   for (i = 0; i < BENCH_OPS; i++) {
+      u_int32_t slot = rand() % BENCH_LIVE;
+      if (ptr[slot] != NULL) vlad_free(ptr[slot]);
+      ptr[slot] = vlad_malloc(1 + rand() % 256);
+   }
+   double elapsed = now() - start;
+
+   printf("%-16s %8s %12.0f %9.0fKB\n", "small churn", background ? "thread" : "off",
+          2 * BENCH_OPS / elapsed, residentKB());
+   for (i = 0; i < BENCH_LIVE; i++) {
+      if (ptr[i] != NULL) vlad_free(ptr[i]);
+   }
+   vlad_end();
+}
+
+// resident part of the first arena's memory[], by mincore
+static double residentKB(void)
+{
+   size_t page = sysconf(_SC_PAGESIZE);
+   size_t pages = memory_size / page, i, resident = 0;
+   unsigned char *pagesIn = malloc(pages);
+
+   if (pagesIn == NULL || mincore(memory, memory_size, pagesIn) != 0) {
+      free(pagesIn);
+      return -1;
+   }
+   for (i = 0; i < pages; i++) {
+      resident += pagesIn[i] & 1;
+   }
+   free(pagesIn);
+   return resident * page / 1024.0;
+}
+
+static double now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// each thread churns its own THREAD_LIVE objects; prints total ops/sec
+static void runThreads(u_int32_t threads, u_int32_t numArenas)
+{
+   pthread_t tid[MAX_THREADS];
+   u_int32_t t;
+
+   vlad_init_arenas(BENCH_MEMORY * 4, numArenas);
+   double start = now();
+   for (t = 0; t < threads; t++) {
+      pthread_create(&tid[t], NULL, threadChurn, (void *) (long) t);
+   }
+   for (t = 0; t < threads; t++) {
+      pthread_join(tid[t], NULL);
+   }
+   double elapsed = now() - start;
+   printf(" %14.0f", 2.0 * threads * THREAD_OPS / elapsed);
+   vlad_end();
+}
+
+static void *threadChurn(void *arg)
+{
+   void *ptr[THREAD_LIVE] = { NULL };
+   unsigned int seed = (unsigned int) (long) arg;
+   u_int32_t i;
+
+   for (i = 0; i < THREAD_OPS; i++) {
+      u_int32_t slot = rand_r(&seed) % THREAD_LIVE;
+      if (ptr[slot] != NULL) vlad_free(ptr[slot]);
+      ptr[slot] = vlad_malloc(1 + rand_r(&seed) % 256);
+   }
+   for (i = 0; i < THREAD_LIVE; i++) {
+      if (ptr[i] != NULL) vlad_free(ptr[i]);
+   }
+   return NULL;
+}
+
+// time each best-fit kernel over a free-list index of `count` random
+// sizes, checking that they all pick the same entries
+static void runSearch(u_int32_t count)
+{
+   vsize_t *sizes = malloc(count * sizeof(vsize_t));
+   u_int32_t i;
+
+   srand(1927);
+   for (i = 0; i < count; i++) {
+      sizes[i] = MIN_MEMORY + 4 * (rand() % 16384);
+   }
+
+   u_int32_t scalar = 0, sse = 0, avx = 0;
+   printf("%-8u %10.1f", count, timeSearch(scanBestFit, sizes, count, &scalar));
+#ifdef INDEX_SIMD
+   if (__builtin_cpu_supports("sse4.1")) {
+      printf(" %10.1f", timeSearch(bestFitSSE41, sizes, count, &sse));
+   } else {
+      printf(" %10s", "-");
+      sse = scalar;
+   }
+   if (__builtin_cpu_supports("avx2")) {
+      printf(" %10.1f", timeSearch(bestFitAVX2, sizes, count, &avx));
+   } else {
+      printf(" %10s", "-");
+      avx = scalar;
+   }
+#else
+   printf(" %10s %10s", "-", "-");
+   sse = avx = scalar;
+#endif
+   printf("%s\n", (sse == scalar && avx == scalar) ? "" : "   MISMATCH");
+   free(sizes);
+}
+
+// returns ns per search; *check is a checksum of the entries found
+static double timeSearch(int (*search)(const vsize_t *, u_int32_t, vsize_t),
+                         const vsize_t *sizes, u_int32_t count, u_int32_t *check)
+{
+   u_int32_t reps = SEARCH_WORK / count, i;
+   unsigned int seed = 42;
+
+   double start = now();
+   for (i = 0; i < reps; i++) {
+      vsize_t n = MIN_MEMORY + 4 * (rand_r(&seed) % 16384);
+      *check = *check * 31 + search(sizes, count, n);
+   }
+   return (now() - start) * 1e9 / reps;
+}
+
+// opens the hardware counters for this thread, in user mode, stopped,
+// as one group: they are then started, stopped and read together, and
+// are all on the PMU at once or not at all; returns how many could be
+// opened (if none, says why)
+static int openCounters(void)
+{
+   int c, why = 0;
+
+   for (c = 0; c < COUNTERS; c++) {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = counters[c].type;
+      attr.config = counters[c].config;
+      attr.disabled = (leader == NO_GROUP);   // the others follow the leader
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED
+                         | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      counters[c].fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+      if (counters[c].fd >= 0) {
+         if (leader == NO_GROUP) leader = counters[c].fd;
+         counters[c].slot = members++;
+      } else if (why == 0) {
+         why = errno;
+      }
+   }
+   if (members == 0) {
+      printf("(no hardware counters: perf_event_open: %s)\n", strerror(why));
+   }
+   return members;
+}
+
+static void closeCounters(void)
+{
+   int c;
+   // the leader last
+   for (c = COUNTERS - 1; c >= 0; c--) {
+      if (counters[c].fd >= 0) close(counters[c].fd);
+      counters[c].fd = -1;
+   }
+   leader = NO_GROUP;
+   members = 0;
+}
+
+static void countOn(void)
+{
+   if (leader != NO_GROUP) {
+      ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+   }
+}
+
+static void countOff(void)
+{
+   if (leader != NO_GROUP) {
+      ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+   }
+}
+
+// values[c] = counts since the last reset, scaled up for the time the
+// group was not running (when other events need the PMU, the kernel
+// takes turns); -1 if the counter is not open. One read returns the
+// whole group.
+static void readCounters(double *values)
+{
+   u_int64_t group[3 + COUNTERS];   // # counters, time enabled, time running,
+                                    // then the value of each
+   int c;
+
+   for (c = 0; c < COUNTERS; c++) values[c] = -1;
+   ssize_t want = (3 + members) * sizeof(u_int64_t);
+   if (leader == NO_GROUP || read(leader, group, want) != want) return;
+
+   for (c = 0; c < COUNTERS; c++) {
+      if (counters[c].fd < 0) continue;
+      u_int64_t count = group[3 + counters[c].slot];
+      values[c] = (group[2] > 0) ? (double) count * group[1] / group[2] : 0;
+   }
+   ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+}
+
+// keep BENCH_LIVE objects live as in runChurn, but each step frees BATCH
+// of them at random and then allocates their replacements, so that
+// vlad_free and vlad_malloc are counted apart; prints counts per call
+static void runCounters(workload_t *w, engine_t *e)
+{
+   void *ptr[BENCH_LIVE];
+   u_int32_t size[BENCH_LIVE], order[BENCH_LIVE];
+   double frees[COUNTERS] = { 0 }, mallocs[COUNTERS] = { 0 }, values[COUNTERS];
+   u_int32_t i, b, c;
+
+   srand(1927);
+   vlad_init(BENCH_MEMORY);
+   vlad_set_lazy(e->budget);
+   vlad_set_index(e->index);
+   for (i = 0; i < BENCH_LIVE; i++) {
+      size[i] = w->nextSize(i, 0);
+      ptr[i] = vlad_malloc(size[i]);
+      order[i] = i;
+   }
+
+   readCounters(values);
+   for (i = 0; i < BENCH_OPS / BATCH; i++) {
+      // the first BATCH of order[] become a random choice of slots
+      for (b = 0; b < BATCH; b++) {
+         u_int32_t other = b + rand() % (BENCH_LIVE - b);
+         u_int32_t slot = order[other];
+         order[other] = order[b];
+         order[b] = slot;
+      }
+
+      countOn();
+      for (b = 0; b < BATCH; b++) {
+         vlad_free(ptr[order[b]]);
+      }
+      countOff();
+      readCounters(values);
+      for (c = 0; c < COUNTERS; c++) frees[c] += values[c];
+
+      for (b = 0; b < BATCH; b++) {
+         size[order[b]] = w->nextSize(order[b], size[order[b]]);
+      }
+      countOn();
+      for (b = 0; b < BATCH; b++) {
+         ptr[order[b]] = vlad_malloc(size[order[b]]);
+      }
+      countOff();
+      readCounters(values);
+      for (c = 0; c < COUNTERS; c++) mallocs[c] += values[c];
+   }
+
+   printCounts(w, e, "malloc", mallocs, BENCH_OPS / BATCH * BATCH);
+   printCounts(w, e, "free", frees, BENCH_OPS / BATCH * BATCH);
+   vlad_end();
+}
+
+static void printCounts(workload_t *w, engine_t *e, const char *op,
+                        double *values, u_int32_t ops)
+{
+   int c;
+
+   printf("%-16s %-6s %-6s", w->name, e->name, op);
+   for (c = 0; c < COUNTERS; c++) {
+      if (counters[c].fd >= 0) {
+         printf(" %9.2f", values[c] / ops);
+      } else {
+         printf(" %9s", "-");
+      }
+   }
+   printf("\n");
+}
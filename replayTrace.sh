@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Replay recorded heap traces through vlad under each placement policy
+# replayTrace.sh ... prints failed requests and ops/sec for each
+#
+# make vlad
+# ./replayTrace.sh SIZE TRACE ...
+#
+# SIZE is the arena size (vlad -m), and each TRACE a vlad script, e.g.
+# one recorded by libvladtrace.so (see vladTrace.c), or xz-compressed as
+# traces/python.vlad.xz is. That one was recorded (with SIZE 16777216) from
+#
+#   PYTHONMALLOC=malloc VLAD_TRACE=python LD_PRELOAD=$PWD/libvladtrace.so \
+#   python3 -c "
+#   import json,random
+#   random.seed(1)
+#   d=[{'k%d'%i:[random.random() for _ in range(random.randint(1,20))],
+#       's':'x'*random.randint(1,300)} for i in range(5000)]
+#   s=json.dumps(d); e=json.loads(s); print(len(s))"
+#
+# Times are from one run each, so expect them to vary by 10% or so.
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 SIZE TRACE ..." >&2
+    exit 1
+fi
+size=$1
+shift
+
+# compressed traces are unpacked first, so as not to time xz as well
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+
+for trace in "$@"; do
+    case $trace in
+    *.xz) xz -dc "$trace" > "$script" ;;
+    *)    cp "$trace" "$script" ;;
+    esac
+    for config in "best 32" "best 16" "first 32" "adaptive 16,256" "adaptive 32,256"; do
+        set -- $config
+        result=$(./vlad -b -m $size -p $1 -s $2 < "$script")
+        failed=$(echo "$result" | sed -n 's/.* \([0-9]*\) failed.*/\1/p')
+        ops=$(echo "$result" | sed -n 's/.*sec, \([0-9]*\) ops.*/\1/p')
+        echo "$trace $1 $2: $failed failed, $ops ops/sec"
+    done
+done
@@ -0,0 +1,106 @@
+// make testAdapters && ./testAdapters
+// Unit tests for the C++ adapters in allocator.hpp
+// (allocator.c is compiled as C and linked in, see the Makefile)
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <memory_resource>
+#include <new>
+#include <vector>
+
+#include "allocator.hpp"
+
+struct alignas(64) Wide {
+   char bytes[64];
+};
+
+static u_int32_t liveBlocks(void);
+static void printLine(void);
+
+int main(void) {
+   fprintf(stderr, "\n---------- > C++ adapter test < ----------\n\n");
+   vlad_init_arenas(1 << 16, 2);
+
+   fprintf(stderr, "Testing vlad::arena_resource ......\n");
+   fprintf(stderr, "> 1. a pmr::vector<int> in arena 0 grows in Vlad\n");
+   {
+      vlad::arena_resource arena0(0);
+      std::pmr::vector<int> v(&arena0);
+      for (int i = 0; i < 1000; i++) v.push_back(i);
+      assert(vlad_owns(v.data()));
+      assert(reinterpret_cast<std::uintptr_t>(v.data()) % alignof(int) == 0);
+      for (int i = 0; i < 1000; i++) assert(v[i] == i);
+      assert(liveBlocks() == 1);
+   }
+   assert(liveBlocks() == 0);
+   fprintf(stderr, "> 2. resources over different arenas compare equal\n");
+   vlad::arena_resource arena1(1), anywhere;
+   assert(arena1.is_equal(anywhere) && anywhere.is_equal(arena1));
+   assert(!arena1.is_equal(*std::pmr::new_delete_resource()));
+   fprintf(stderr, "> 3. no room in the arena --> std::bad_alloc\n");
+   bool threw = false;
+   try {
+      (void) arena1.allocate(1 << 20);
+   } catch (const std::bad_alloc &) {
+      threw = true;
+   }
+   assert(threw);
+   fprintf(stderr, "passed!\n");
+   printLine();
+
+   fprintf(stderr, "Testing vlad::allocator<T> ......\n");
+   fprintf(stderr, "> 1. a std::vector<long> on any arena\n");
+   {
+      std::vector<long, vlad::allocator<long>> v;
+      for (long i = 0; i < 500; i++) v.push_back(i * i);
+      assert(vlad_owns(v.data()));
+      for (long i = 0; i < 500; i++) assert(v[i] == i * i);
+   }
+   assert(liveBlocks() == 0);
+   fprintf(stderr, "> 2. a std::list rebinds the allocator to its nodes\n");
+   {
+      std::list<int, vlad::allocator<int>> l(vlad::allocator<int>(1));
+      for (int i = 0; i < 100; i++) l.push_back(i);
+      assert(vlad_owns(&l.front()) && vlad_owns(&l.back()));
+      assert(liveBlocks() == 100);
+   }
+   assert(liveBlocks() == 0);
+   fprintf(stderr, "> 3. over-aligned elements keep their alignment\n");
+   {
+      std::vector<Wide, vlad::allocator<Wide>> v(3);
+      assert(reinterpret_cast<std::uintptr_t>(v.data()) % 64 == 0);
+   }
+   assert(liveBlocks() == 0);
+   fprintf(stderr, "> 4. allocators compare equal whatever their arena or type\n");
+   assert(vlad::allocator<int>(0) == vlad::allocator<double>(1));
+   assert(!(vlad::allocator<int>() != vlad::allocator<char>(0)));
+   fprintf(stderr, "> 5. reserving 2.25GB (more than a block holds) --> std::bad_alloc\n");
+   threw = false;
+   try {
+      std::vector<char, vlad::allocator<char>> v;
+      v.reserve(0x90000000);
+   } catch (const std::bad_alloc &) {
+      threw = true;
+   }
+   assert(threw);
+   assert(liveBlocks() == 0);
+   fprintf(stderr, "passed!\n");
+   printLine();
+
+   vlad_end();
+   fprintf(stderr, "\nAll tests passed! You are awesome!\n\n");
+   return EXIT_SUCCESS;
+}
+
+// number of blocks allocated in every arena, after checking the heap
+static u_int32_t liveBlocks(void) {
+   vlad_report_t report;
+   assert(vlad_check(&report) == 0);
+   return report.alloc_blocks;
+}
+
+static void printLine(void) {
+   fprintf(stderr, "------------------------------------------\n\n");
+}
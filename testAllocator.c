@@ -5,6 +5,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
 #include "allocator.h"
 #include "allocator.c"
 
@@ -13,6 +16,12 @@
 
 void unitTest(void);
 void printLine(void);
+int exitedWithFailure(pid_t child);
+void *freeRemotely(void *object);
+void *churn(void *unused);
+#ifdef INDEX_SIMD
+void compareBestFits(const vsize_t *sizes, u_int32_t count, vsize_t n);
+#endif
 
 
 int main(int argc, char *argv[]) {
@@ -321,13 +330,958 @@ void unitTest(void) {
    fprintf(stderr, "passed!\n");
    printLine();
 
+   fprintf(stderr, "Testing vlad_check() ......\n");
+   vlad_report_t report;
+   fprintf(stderr, "> 1. one free region\n");
+   assert(vlad_check(&report) == 0);
+   assert(report.blocks == 1);
+   assert(report.free_blocks == 1);
+   assert(report.free_bytes == 2048);
+   assert(report.list_blocks == 1);
+   assert(report.list_bytes == 2048);
+
+   fprintf(stderr, "> 2. ptr1 = vlad_malloc(100), ptr2 = vlad_malloc(200)\n");
+   ptr1 = vlad_malloc(100);
+   ptr2 = vlad_malloc(200);
+   assert(vlad_check(&report) == 0);
+   assert(report.blocks == 3);
+   assert(report.alloc_blocks == 2);
+   assert(report.alloc_bytes == 108 + 208);
+   assert(report.free_bytes == 2048 - 108 - 208);
+
+   fprintf(stderr, "> 3. corrupt the header of ptr2\n");
+   allocRegion = (alloc_header_t *) &memory[108];
+   allocRegion->magic = 0;
+   assert(vlad_check(&report) > 0);
+   assert(report.bad_offset == 108);
+   assert(report.message != NULL);
+   allocRegion->magic = MAGIC_ALLOC;
+
+   fprintf(stderr, "> 4. break the free list links\n");
+   freeRegion = (free_header_t *) &memory[316];
+   freeRegion->prev = 108;
+   assert(vlad_check(&report) > 0);
+   freeRegion->prev = 316;
+   assert(vlad_check(&report) == 0);
+
+   fprintf(stderr, "> 5. vlad_map() of alloc,alloc,free\n");
+   FILE *map = tmpfile();
+   char line[BUFSIZ];
+   assert(vlad_map(map, VLAD_MAP_CSV) == 0);
+   rewind(map);
+   assert(fgets(line, BUFSIZ, map) != NULL);
+   assert(fgets(line, BUFSIZ, map) != NULL);
+   assert(fgets(line, BUFSIZ, map) != NULL);
+   assert(strcmp(line, "alloc,0,316,2\n") == 0);
+   assert(fgets(line, BUFSIZ, map) != NULL);
+   assert(strcmp(line, "free,316,1732,1\n") == 0);
+   fclose(map);
+
+   vlad_free(ptr2);
+   vlad_free(ptr1);
+   assert(vlad_check(&report) == 0);
+   assert(report.blocks == 1);
+   fprintf(stderr, "passed!\n");
+   printLine();
+
+   fprintf(stderr, "Testing vlad_set_lazy() ......\n");
+   fprintf(stderr, "> 1. a freed 108 byte block is cached, then reused as is\n");
+   vlad_set_lazy(256);
+   ptr1 = vlad_malloc(100);
+   ptr2 = vlad_malloc(100);
+   ptr3 = vlad_malloc(100);
+   ptr4 = vlad_malloc(40);
+   ptr5 = vlad_malloc(1600);
+   assert(ptr5 == &memory[372 + ALLOC_HEADER_SIZE]);
+   vlad_free(ptr1);
+   assert(((alloc_header_t *) &memory[0])->magic == MAGIC_CACHED);
+   assert(vlad_check(&report) == 0);
+   assert(report.cached_blocks == 1 && report.cached_bytes == 108);
+   u_int32_t hits = cache_hits;
+   ptr6 = vlad_malloc(100);
+   assert(ptr6 == ptr1);
+   assert(cache_hits == hits + 1);
+   assert(cache_bytes == 0);
+   fprintf(stderr, "> 2. going over budget merges what was cached first\n");
+   vlad_free(ptr1);
+   vlad_free(ptr3);
+   assert(cache_bytes == 216);
+   vlad_free(ptr2);
+   assert(cache_bytes == 108);
+   assert(((alloc_header_t *) &memory[108])->magic == MAGIC_CACHED);
+   assert(((free_header_t *) &memory[0])->magic == MAGIC_FREE);
+   assert(((free_header_t *) &memory[216])->magic == MAGIC_FREE);
+   assert(vlad_check(&report) == 0);
+   assert(report.cached_blocks == 1 && report.free_blocks == 3);
+   fprintf(stderr, "> 3. vlad_malloc(300) only fits once the cache is merged\n");
+   ptr1 = vlad_malloc(300);
+   assert(ptr1 == &memory[ALLOC_HEADER_SIZE]);
+   assert(cache_bytes == 0);
+   assert(vlad_check(&report) == 0);
+   assert(report.cached_blocks == 0 && report.free_blocks == 1);
+   vlad_set_lazy(0);
+   vlad_free(ptr1);
+   vlad_free(ptr4);
+   vlad_free(ptr5);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 1);
+   fprintf(stderr, "passed!\n");
+   printLine();
+
+   fprintf(stderr, "Testing vlad_free_sized() ......\n");
+   fprintf(stderr, "> 1. eager mode: the block is freed as by vlad_free\n");
+   ptr1 = vlad_malloc(100);
+   ptr2 = vlad_malloc(50);
+   vlad_free_sized(ptr1, 100);
+   assert(((free_header_t *) &memory[0])->magic == MAGIC_FREE);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 2 && report.cached_blocks == 0);
+   fprintf(stderr, "> 2. lazy mode: it goes straight into its cache bin\n");
+   vlad_set_lazy(256);
+   ptr1 = vlad_malloc(100);
+   vlad_free_sized(ptr1, 100);
+   assert(((alloc_header_t *) &memory[0])->magic == MAGIC_CACHED);
+   vlad_set_lazy(0);
+   assert(((free_header_t *) &memory[0])->magic == MAGIC_FREE);
+   fprintf(stderr, "> 3. freeing it again, or with too big a size, exits\n");
+   fflush(stdout);   // or the child's exit() writes it out again
+   pid_t child = fork();
+   if (child == 0) {
+      vlad_free_sized(ptr1, 100);
+      _exit(EXIT_SUCCESS);
+   }
+   assert(exitedWithFailure(child));
+   child = fork();
+   if (child == 0) {
+      vlad_free_sized(ptr2, 500);
+      _exit(EXIT_SUCCESS);
+   }
+   assert(exitedWithFailure(child));
+   vlad_free_sized(ptr2, 50);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 1);
+   fprintf(stderr, "passed!\n");
+   printLine();
+
+   fprintf(stderr, "Testing vlad_calloc() ......\n");
+   fprintf(stderr, "> 1. fill and free a block, then vlad_calloc(10, 4)\n");
+   ptr1 = vlad_malloc(40);
+   memset(ptr1, 0xFF, 40);
+   vlad_free(ptr1);
+   ptr1 = vlad_calloc(10, 4);
+   assert(ptr1 != NULL);
+   int i;
+   for (i = 0; i < 40; i++) assert(ptr1[i] == 0);
+
+   fprintf(stderr, "> 2. vlad_calloc(10, 100) from never-used memory\n");
+   ptr2 = vlad_calloc(10, 100);
+   assert(ptr2 != NULL);
+   for (i = 0; i < 1000; i++) assert(ptr2[i] == 0);
+
+   fprintf(stderr, "> 3. vlad_calloc(0x10000, 0x10000) overflows --> NULL\n");
+   assert(vlad_calloc(0x10000, 0x10000) == NULL);
+   fprintf(stderr, "> 4. vlad_calloc(1, 2^31) and (1, 2^32 - 1) are too big --> NULL\n");
+   assert(vlad_calloc(1, 0x80000000) == NULL);
+   assert(vlad_calloc(1, 0xFFFFFFFF) == NULL);
+   assert(vlad_calloc(0x8000, 0x10000) == NULL);
+   vlad_free(ptr2);
+   vlad_free(ptr1);
+   assert(vlad_check(&report) == 0);
+   fprintf(stderr, "passed!\n");
+   printLine();
+
+   fprintf(stderr, "Testing vlad_usable_size() & vlad_good_size() ......\n");
+   assert(vlad_good_size(1) == 8);
+   assert(vlad_good_size(20) == 20);
+   assert(vlad_good_size(21) == 24);
+   assert(vlad_good_size(0x7FFFFFF0) >= 0x7FFFFFF0);
+   assert(vlad_good_size(0x80000000) >= 0x80000000);
+   assert(vlad_good_size(0xFFFFFFFF) == 0);
+   ptr1 = vlad_malloc(21);
+   assert(vlad_usable_size(ptr1) == 24);
+   ptr2 = vlad_malloc(100);
+   ptr3 = vlad_malloc(8);
+   vlad_free(ptr2);
+   fprintf(stderr, "> vlad_malloc(80) is given all of a free 108 byte block\n");
+   ptr2 = vlad_malloc(80);
+   assert(vlad_good_size(80) == 80);
+   assert(vlad_usable_size(ptr2) == 100);
+   vlad_free(ptr2);
+   assert(vlad_usable_size(ptr2) == 0);
+   vlad_free(ptr3);
+   vlad_free(ptr1);
+   assert(vlad_check(&report) == 0);
+   fprintf(stderr, "passed!\n");
+   printLine();
+
+   fprintf(stderr, "Testing vlad_free_remote() ......\n");
+   fprintf(stderr, "> 1. another thread frees a block: it is only queued\n");
+   ptr1 = vlad_malloc(100);
+   ptr2 = vlad_malloc(50);
+   pthread_t thread;
+   assert(pthread_create(&thread, NULL, freeRemotely, ptr1) == 0);
+   assert(pthread_join(thread, NULL) == 0);
+   assert(((alloc_header_t *) &memory[0])->magic == MAGIC_QUEUED);
+   assert(remote_free_head == 0);
+   assert(vlad_check(&report) == 0);
+   assert(report.alloc_blocks == 2 && report.free_blocks == 1);
+   fprintf(stderr, "> 2. freeing it again, remotely or not, exits\n");
+   fflush(stdout);
+   child = fork();
+   if (child == 0) {
+      vlad_free_remote(ptr1);
+      _exit(EXIT_SUCCESS);
+   }
+   assert(exitedWithFailure(child));
+   child = fork();
+   if (child == 0) {
+      vlad_free(ptr1);
+      _exit(EXIT_SUCCESS);
+   }
+   assert(exitedWithFailure(child));
+   fprintf(stderr, "> 3. the next vlad_malloc drains the queue\n");
+   ptr3 = vlad_malloc(1000);
+   assert(remote_free_head == NO_BLOCK);
+   assert(((free_header_t *) &memory[0])->magic == MAGIC_FREE);
+   vlad_free(ptr3);
+   vlad_free(ptr2);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 1);
+   fprintf(stderr, "passed!\n");
+   printLine();
+
+   fprintf(stderr, "Testing vlad_init_arenas() ......\n");
+   fprintf(stderr, "> 1. two arenas of 2048 bytes\n");
+   vlad_end();
+   vlad_init_arenas(2013, 2);
+   assert(num_arenas == 2);
+   assert(arenas[0].start != NULL && arenas[1].start != NULL);
+   assert(arenas[0].start != arenas[1].start);
+   fprintf(stderr, "> 2. a request the home arena cannot take spills to the other\n");
+   ptr1 = vlad_malloc(1500);
+   ptr2 = vlad_malloc(1500);
+   assert(ptr1 != NULL && ptr2 != NULL);
+   assert(findArena(ptr1) != NULL && findArena(ptr2) != NULL);
+   assert(findArena(ptr1) != findArena(ptr2));
+   assert(vlad_malloc(1500) == NULL);
+   assert(vlad_arena_alloc(findArena(ptr2) - arenas, 4, 1000) == NULL);
+   vlad_free(ptr2);
+   vlad_free(ptr1);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 2 && report.free_bytes == 2 * 2048);
+   fprintf(stderr, "> 3. two threads allocating and freeing at once\n");
+   pthread_t threads[2];
+   for (i = 0; i < 2; i++) {
+      assert(pthread_create(&threads[i], NULL, churn, NULL) == 0);
+   }
+   for (i = 0; i < 2; i++) {
+      assert(pthread_join(threads[i], NULL) == 0);
+   }
+   assert(vlad_check(&report) == 0);
+   assert(report.alloc_blocks == 0 && report.cached_blocks == 0);
+   assert(report.free_blocks == 2);
+   vlad_end();
+   vlad_init(2013);
+   fprintf(stderr, "passed!\n");
+   printLine();
+
+   fprintf(stderr, "Testing vlad_init_numa() ......\n");
+   fprintf(stderr, "> 1. an arena bound to no node (-1) works\n");
+   vlad_end();
+   arena = &arenas[0];
+   initArena(2048, -1);
+   num_arenas = 1;
+   assert(arenas[0].node == -1);
+   ptr1 = vlad_malloc(100);
+   assert(ptr1 != NULL && findArena(ptr1) == &arenas[0]);
+   vlad_free(ptr1);
+   assert(vlad_check(&report) == 0 && report.free_blocks == 1);
+   vlad_end();
+   fprintf(stderr, "> 2. so does one whose node cannot be bound to (mbind fails)\n");
+   arena = &arenas[0];
+   initArena(2048, 63);
+   num_arenas = 1;
+   assert(arenas[0].node == 63);
+   ptr1 = vlad_malloc(100);
+   assert(ptr1 != NULL && findArena(ptr1) == &arenas[0]);
+   memset(ptr1, 1, 100);
+   vlad_free(ptr1);
+   assert(vlad_check(&report) == 0 && report.free_blocks == 1);
+   vlad_end();
+   fprintf(stderr, "> 3. and so do the arenas for the nodes that are online\n");
+   vlad_init_numa(2013);
+   assert(num_arenas >= 1);
+   ptr1 = vlad_malloc(100);
+   assert(ptr1 != NULL && findArena(ptr1) != NULL);
+   vlad_free(ptr1);
+   assert(vlad_check(&report) == 0 && report.free_blocks == num_arenas);
+   vlad_end();
+   vlad_init(2013);
+   fprintf(stderr, "passed!\n");
+   printLine();
+
+   fprintf(stderr, "Testing handles & vlad_compact() ......\n");
+   fprintf(stderr, "> 1. three handles of 100 bytes, free the first and last\n");
+   vlad_handle_t h1 = vlad_handle_alloc(100);
+   vlad_handle_t h2 = vlad_handle_alloc(100);
+   vlad_handle_t h3 = vlad_handle_alloc(100);
+   assert(h1 != 0 && h2 != 0 && h3 != 0);
+   assert((byte *) vlad_handle_get(h2) == &memory[112 + 12]);
+   memset(vlad_handle_get(h2), 42, 100);
+   vlad_handle_free(h1);
+   vlad_handle_free(h3);
+   assert(vlad_handle_get(h1) == NULL);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 2);
+
+   fprintf(stderr, "> 2. vlad_compact() slides h2 to offset 0\n");
+   assert(vlad_compact() == 112);
+   ptr1 = vlad_handle_get(h2);
+   assert(ptr1 == &memory[12]);
+   for (i = 0; i < 100; i++) assert(ptr1[i] == 42);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 1);
+   assert(report.free_bytes == 2048 - 112);
+   assert(vlad_compact() == 0);
+   vlad_handle_free(h2);
+   fprintf(stderr, "> 3. 100 handles: handles[] grows past its first 64 slots\n");
+   vlad_handle_t many[100];
+   for (i = 0; i < 100; i++) {
+      many[i] = vlad_handle_alloc(1);
+      assert(many[i] != 0);
+      *(byte *) vlad_handle_get(many[i]) = i;
+   }
+   for (i = 0; i < 100; i++) {
+      assert(*(byte *) vlad_handle_get(many[i]) == i);
+      vlad_handle_free(many[i]);
+   }
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 1);
+   fprintf(stderr, "passed!\n");
+   printLine();
+
+   fprintf(stderr, "Testing vlad_snapshot() & vlad_restore() ......\n");
+   fprintf(stderr, "> 1. snapshot with one block and one handle allocated\n");
+   ptr1 = vlad_malloc(50);
+   h1 = vlad_handle_alloc(60);
+   memset(ptr1, 7, 50);
+   byte saved[2048];
+   memcpy(saved, memory, 2048);
+   vlad_snapshot_t *snapshot = vlad_snapshot();
+   assert(snapshot != NULL);
+
+   fprintf(stderr, "> 2. change the heap, then restore it\n");
+   vlad_free(ptr1);
+   vlad_handle_free(h1);
+   ptr2 = vlad_malloc(500);
+   memset(ptr2, 9, 500);
+   assert(vlad_restore(snapshot) == 0);
+   assert(memcmp(saved, memory, 2048) == 0);
+   assert(vlad_check(&report) == 0);
+   assert(report.alloc_blocks == 2);
+   assert(vlad_handle_get(h1) != NULL);
+
+   fprintf(stderr, "> 3. restore again after freeing everything\n");
+   vlad_free(ptr1);
+   vlad_handle_free(h1);
+   assert(vlad_restore(snapshot) == 0);
+   assert(memcmp(saved, memory, 2048) == 0);
+   vlad_snapshot_free(snapshot);
+   vlad_free(ptr1);
+   vlad_handle_free(h1);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 1);
+   fprintf(stderr, "passed!\n");
+   printLine();
+
+   fprintf(stderr, "Testing vlad_arena_alloc() ......\n");
+   fprintf(stderr, "> 1. 100 bytes aligned to 64 from arena 0\n");
+   ptr1 = vlad_arena_alloc(0, 64, 100);
+   assert(ptr1 != NULL && ((uintptr_t) ptr1) % 64 == 0);
+   assert(ptr1 > memory && ptr1 < memory + memory_size);
+   assert(vlad_usable_size(ptr1) >= 100);
+   fprintf(stderr, "> 2. there is no arena 1 --> NULL\n");
+   assert(vlad_arena_alloc(1, 4, 10) == NULL);
+   vlad_free_sized(ptr1, 100);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 1);
+   fprintf(stderr, "passed!\n");
+   printLine();
+
+   fprintf(stderr, "Testing vlad_realloc() & vlad_aligned_alloc() ......\n");
+   fprintf(stderr, "> 1. shrinking a block leaves it where it is\n");
+   ptr1 = vlad_malloc(100);
+   ptr2 = vlad_malloc(50);
+   memset(ptr1, 5, 100);
+   assert(vlad_realloc(ptr1, 40) == ptr1);
+   assert(vlad_usable_size(ptr1) >= 100);
+   fprintf(stderr, "> 2. growing into the free block after it, in place\n");
+   vlad_free(ptr2);
+   assert(vlad_realloc(ptr1, 300) == ptr1);
+   assert(vlad_usable_size(ptr1) >= 300);
+   for (i = 0; i < 100; i++) assert(ptr1[i] == 5);
+   assert(vlad_check(&report) == 0);
+   assert(report.alloc_blocks == 1 && report.free_blocks == 1);
+   fprintf(stderr, "> 3. growing past the block after it moves it\n");
+   ptr2 = vlad_malloc(50);
+   assert(ptr2 == ptr1 + vlad_usable_size(ptr1) + ALLOC_HEADER_SIZE);
+   ptr3 = vlad_realloc(ptr1, 1000);
+   assert(ptr3 != NULL && ptr3 != ptr1);
+   if (((uintptr_t) ptr1) % 16 == 0) assert(((uintptr_t) ptr3) % 16 == 0);
+   for (i = 0; i < 100; i++) assert(ptr3[i] == 5);
+   assert(((free_header_t *) &memory[0])->magic == MAGIC_FREE);
+   vlad_free(ptr3);
+   vlad_free(ptr2);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 1);
+   fprintf(stderr, "> 4. 0 to 3 bytes aligned to 8 and 16, after blocks that put\n");
+   fprintf(stderr, ">    them at every offset (the lead block is freed)\n");
+   u_int32_t align, n, before;
+   for (align = 8; align <= 16; align *= 2) {
+      for (n = 0; n <= 3; n++) for (before = 1; before <= 32; before += 4) {
+         ptr1 = vlad_malloc(before);
+         ptr2 = vlad_aligned_alloc(align, n);
+         assert(ptr2 != NULL && ((uintptr_t) ptr2) % align == 0);
+         assert(vlad_usable_size(ptr2) >= n);
+         memset(ptr2, 0xAB, n);
+         assert(vlad_check(&report) == 0);
+         vlad_free(ptr1);
+         vlad_free(ptr2);
+         assert(vlad_check(&report) == 0);
+         assert(report.free_blocks == 1);
+      }
+   }
+   fprintf(stderr, "> 5. 0 to 3 bytes aligned to 4096 (64KB heap)\n");
+   vlad_end();
+   vlad_init(1 << 16);
+   for (n = 0; n <= 3; n++) {
+      ptr1 = vlad_malloc(n + 1);
+      ptr2 = vlad_aligned_alloc(4096, n);
+      assert(ptr2 != NULL && ((uintptr_t) ptr2) % 4096 == 0);
+      assert(vlad_usable_size(ptr2) >= n);
+      memset(ptr2, 0xAB, n);
+      assert(vlad_check(&report) == 0);
+      vlad_free(ptr2);
+      vlad_free(ptr1);
+      assert(vlad_check(&report) == 0);
+      assert(report.free_blocks == 1);
+   }
+   vlad_end();
+   vlad_init(2013);
+   fprintf(stderr, "> 6. growing to 2^31 bytes or more fails and keeps the block\n");
+   ptr1 = vlad_malloc(100);
+   memset(ptr1, 5, 100);
+   assert(vlad_realloc(ptr1, 0x90000000) == NULL);
+   assert(vlad_realloc(ptr1, 0xFFFFFFFF) == NULL);
+   assert(vlad_malloc(0x80000000) == NULL);
+   assert(vlad_usable_size(ptr1) >= 100 && vlad_usable_size(ptr1) < 200);
+   for (i = 0; i < 100; i++) assert(ptr1[i] == 5);
+   vlad_free(ptr1);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 1);
+   fprintf(stderr, "passed!\n");
+   printLine();
+
+   fprintf(stderr, "Testing vlad_set_mmap_threshold() ......\n");
+   fprintf(stderr, "> 1. vlad_malloc(100000) is mapped outside memory[]\n");
+   vlad_set_mmap_threshold(4096);
+   ptr1 = vlad_malloc(100000);
+   assert(ptr1 != NULL && (ptr1 < memory || ptr1 > memory + memory_size));
+   assert(((uintptr_t) ptr1) % 4096 == HUGE_HEADER_SIZE);
+   assert(vlad_usable_size(ptr1) >= 100000);
+   assert(vlad_owns(ptr1));
+   memset(ptr1, 5, 100000);
+   fprintf(stderr, "> 2. vlad_realloc() to 4MB keeps the contents\n");
+   ptr1 = vlad_realloc(ptr1, 4 << 20);
+   assert(ptr1 != NULL && vlad_usable_size(ptr1) >= (4 << 20));
+   for (i = 0; i < 100000; i++) assert(ptr1[i] == 5);
+   ptr1[(4 << 20) - 1] = 1;
+   fprintf(stderr, "> 3. vlad_calloc(1000, 100) is zeroed\n");
+   ptr2 = vlad_calloc(1000, 100);
+   assert(ptr2 != NULL && ptr2[0] == 0 && ptr2[99999] == 0);
+   vlad_free(ptr1);
+   vlad_free(ptr2);
+   assert(!vlad_owns(ptr1));
+   fprintf(stderr, "> 4. 200 huge blocks: each is found, moved and freed by address\n");
+   byte *huge[200];
+   for (i = 0; i < 200; i++) {
+      huge[i] = vlad_malloc(5000);
+      assert(huge[i] != NULL && vlad_owns(huge[i]));
+      huge[i][0] = i;
+   }
+   assert(huge_count == 200 && huge_slots >= 400);
+   for (i = 0; i < 200; i += 3) {
+      huge[i] = vlad_realloc(huge[i], 50000);
+      assert(huge[i] != NULL && vlad_owns(huge[i]) && huge[i][0] == (byte) i);
+   }
+   ptr1 = malloc(5000);
+   assert(!vlad_owns(ptr1) && !vlad_owns(ptr1 + HUGE_HEADER_SIZE));
+   free(ptr1);
+   for (i = 0; i < 200; i += 2) vlad_free(huge[i]);
+   for (i = 1; i < 200; i += 2) {
+      assert(vlad_owns(huge[i]) && huge[i][0] == (byte) i);
+      vlad_free(huge[i]);
+   }
+   assert(huge_count == 0 && huge_list == NULL);
+   vlad_set_mmap_threshold(0);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 1);
+   fprintf(stderr, "passed!\n");
+   printLine();
+
+   fprintf(stderr, "Testing vlad_set_granule() & vlad_try_init_arenas() ......\n");
+   fprintf(stderr, "> 1. only 4, 8 or 16, and only while Vlad is not running\n");
+   assert(vlad_set_granule(16) == -1);
+   vlad_end();
+   assert(vlad_set_granule(2) == -1 && vlad_set_granule(12) == -1);
+   assert(vlad_set_granule(32) == -1);
+   assert(vlad_set_granule(16) == 0);
+   vlad_init(2013);
+   fprintf(stderr, "> 2. with a granule of 16 every block is 16 byte aligned\n");
+   byte *blocks[12];
+   for (i = 0; i < 12; i++) {
+      blocks[i] = vlad_malloc(i * 13);
+      assert(blocks[i] != NULL && ((uintptr_t) blocks[i]) % 16 == 0);
+      assert((vlad_usable_size(blocks[i]) + ALLOC_HEADER_SIZE) % 16 == 0);
+   }
+   for (i = 0; i < 12; i += 2) vlad_free(blocks[i]);
+   ptr1 = vlad_realloc(blocks[1], 100);
+   assert(ptr1 != NULL && ((uintptr_t) ptr1) % 16 == 0);
+   fprintf(stderr, "> 3. vlad_aligned_alloc(16, n) needs no lead block\n");
+   ptr3 = vlad_malloc(5);
+   vlad_free(ptr3);
+   ptr2 = vlad_aligned_alloc(16, 5);
+   assert(ptr2 == ptr3 && ((uintptr_t) ptr2) % 16 == 0);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_bytes % 16 == 0 && report.alloc_bytes % 16 == 0);
+   vlad_free(ptr2);
+   vlad_free(ptr1);
+   for (i = 3; i < 12; i += 2) vlad_free(blocks[i]);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 1 && report.free_bytes == 2048);
+   vlad_end();
+   assert(vlad_set_granule(4) == 0);
+   fprintf(stderr, "> 4. arenas that cannot be mapped --> -1, and nothing set up\n");
+   fflush(stdout);
+   child = fork();
+   if (child == 0) {
+      struct rlimit limit = { 64 << 20, 64 << 20 };
+      setrlimit(RLIMIT_AS, &limit);
+      if (vlad_try_init_arenas(1u << 30, 2) != -1) _exit(EXIT_SUCCESS);
+      if (num_arenas != 0 || arenas[0].start != NULL) _exit(EXIT_SUCCESS);
+      if (vlad_malloc(10) != NULL) _exit(EXIT_SUCCESS);
+      _exit(EXIT_FAILURE);
+   }
+   assert(exitedWithFailure(child));
+   assert(vlad_try_init_arenas(2013, 1) == 0);
+   fprintf(stderr, "passed!\n");
+   printLine();
+
+   fprintf(stderr, "Testing vlad_set_index() ......\n");
+   fprintf(stderr, "> 1. free blocks of 108 and 208 bytes between used ones\n");
+   assert(vlad_set_index(1) == 0);
+   assert(arena->index_count == 1);
+   ptr1 = vlad_malloc(100);
+   ptr2 = vlad_malloc(20);
+   ptr3 = vlad_malloc(200);
+   ptr4 = vlad_malloc(20);
+   vlad_free(ptr1);
+   vlad_free(ptr3);
+   assert(arena->index_count == 3);
+   assert(vlad_check(&report) == 0);
+   fprintf(stderr, "> 2. vlad_malloc(150) best fits the 208 byte block\n");
+   ptr1 = vlad_malloc(150);
+   assert(ptr1 == ptr3);
+   assert(arena->index_count == 3);
+   assert(vlad_check(&report) == 0);
+   fprintf(stderr, "> 3. free everything --> one block, one entry\n");
+   vlad_free(ptr1);
+   vlad_free(ptr2);
+   vlad_free(ptr4);
+   assert(arena->index_count == 1);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 1);
+   fprintf(stderr, "> 4. an entry that does not match its header exits\n");
+   fflush(stdout);
+   child = fork();
+   if (child == 0) {
+      arena->index_sizes[0] = 1 << 20;
+      vlad_malloc(4000);
+      _exit(EXIT_SUCCESS);
+   }
+   assert(exitedWithFailure(child));
+   assert(vlad_set_index(0) == 0);
+   assert(arena->index_sizes == NULL);
+   fprintf(stderr, "> 5. 500 free blocks (64KB heap): found by offset as they merge\n");
+   vlad_end();
+   vlad_init(1 << 16);
+   assert(vlad_set_index(1) == 0);
+   byte *small[1200];
+   for (i = 0; i < 1000; i++) small[i] = vlad_malloc(1);
+   for (i = 0; i < 1000; i += 2) vlad_free(small[i]);
+   assert(arena->index_count == 501 && arena->index_slots == 512);
+   assert(vlad_check(&report) == 0 && report.index_lost == 0);
+   for (i = 999; i > 0; i -= 2) vlad_free(small[i]);
+   assert(arena->index_count == 1);
+   assert(vlad_check(&report) == 0 && report.free_blocks == 1);
+   fprintf(stderr, "> 6. no memory to grow it --> dropped, and counted as lost\n");
+   fflush(stdout);
+   child = fork();
+   if (child == 0) {
+      for (i = 0; i < 1200; i++) small[i] = vlad_malloc(1);
+      struct rlimit limit = { 0, 0 };
+      setrlimit(RLIMIT_AS, &limit);
+      for (i = 0; i < 1200; i += 2) vlad_free(small[i]);
+      if (arena->index_sizes != NULL || vlad_check(&report) != 0) _exit(EXIT_SUCCESS);
+      _exit(report.index_lost == 1 ? EXIT_FAILURE : EXIT_SUCCESS);
+   }
+   assert(exitedWithFailure(child));
+   assert(vlad_set_index(0) == 0);
+   vlad_end();
+   vlad_init(2013);
+   fprintf(stderr, "passed!\n");
+   printLine();
+
+   fprintf(stderr, "Testing vlad_set_victim() ......\n");
+   fprintf(stderr, "> 1. a 48 byte hole, then vlad_malloc(200) splits the rest\n");
+   vlad_set_victim(256);
+   ptr1 = vlad_malloc(40);
+   ptr2 = vlad_malloc(40);
+   ptr3 = vlad_malloc(40);
+   vlad_free(ptr2);
+   ptr4 = vlad_malloc(200);
+   fprintf(stderr, "> 2. vlad_malloc(30) is carved right after it, not best fit\n");
+   ptr2 = vlad_malloc(30);
+   assert(ptr2 == ptr4 + 208);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 2);
+   fprintf(stderr, "> 3. after a free, vlad_malloc(30) best fits the hole again\n");
+   vlad_free(ptr2);
+   ptr2 = vlad_malloc(30);
+   assert(ptr2 == ptr1 + 48);
+   vlad_free(ptr1);
+   vlad_free(ptr2);
+   vlad_free(ptr3);
+   vlad_free(ptr4);
+   vlad_set_victim(0);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 1);
+   fprintf(stderr, "passed!\n");
+   printLine();
+
+   fprintf(stderr, "Testing the SSE4.1/AVX2 best-fit kernels ......\n");
+#ifdef INDEX_SIMD
+   fprintf(stderr, "> 1. ties, exact fits and no fit, on 0 to 70 entries\n");
+   vsize_t sizes[70];
+   u_int32_t count, seed = 1927;
+   for (count = 0; count <= 70; count++) {
+      for (i = 0; i < (int) count; i++) {
+         // few distinct sizes, so that there are plenty of ties
+         seed = seed * 1103515245 + 12345;
+         sizes[i] = 16 + 8 * ((seed >> 16) % 12);
+      }
+      vsize_t n;
+      for (n = 8; n <= 120; n += 4) compareBestFits(sizes, count, n);
+   }
+   fprintf(stderr, "> 2. the first of equal sizes wins, across lanes and the tail\n");
+   for (i = 0; i < 70; i++) sizes[i] = 100;
+   sizes[13] = sizes[38] = sizes[69] = 40;
+   assert(scanBestFit(sizes, 70, 40) == 13);
+   compareBestFits(sizes, 70, 40);
+   compareBestFits(sizes, 70, 41);
+   assert(scanBestFit(sizes, 70, 101) == -1);
+   compareBestFits(sizes, 70, 101);
+   sizes[13] = sizes[38] = 100;
+   compareBestFits(sizes, 70, 40);
+   assert(scanBestFit(sizes, 70, 40) == 69);
+#else
+   fprintf(stderr, "> not built with the vector kernels\n");
+#endif
+   fprintf(stderr, "passed!\n");
+   printLine();
+
+   fprintf(stderr, "Testing vlad_malloc_hint() ......\n");
+   fprintf(stderr, "> 1. permanent, then long-lived, from the top down\n");
+   ptr1 = vlad_malloc_hint(100, VLAD_PERMANENT);
+   assert(ptr1 == &memory[2048 - 108 + ALLOC_HEADER_SIZE]);
+   ptr2 = vlad_malloc_hint(100, VLAD_LONG);
+   assert(ptr2 == &memory[2048 - 216 + ALLOC_HEADER_SIZE]);
+   fprintf(stderr, "> 2. short-lived from the bottom up\n");
+   ptr3 = vlad_malloc_hint(50, VLAD_SHORT);
+   assert(ptr3 == &memory[ALLOC_HEADER_SIZE]);
+   ptr4 = vlad_malloc_hint(50, VLAD_SHORT);
+   assert(ptr4 == ptr3 + 60);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 1);
+   fprintf(stderr, "> 3. freeing all but the permanent block leaves one hole\n");
+   vlad_free(ptr3);
+   vlad_free(ptr2);
+   vlad_free(ptr4);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 1);
+   assert(report.free_bytes == 2048 - 108);
+   vlad_free(ptr1);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 1);
+   fprintf(stderr, "> 4. blocks at the top leave the middle clean for vlad_calloc\n");
+   vlad_end();
+   vlad_init(4096);
+   ptr1 = vlad_malloc_hint(100, VLAD_PERMANENT);
+   memset(ptr1, 0xFF, 100);
+   ptr2 = vlad_malloc_hint(100, VLAD_LONG);
+   memset(ptr2, 0xFF, 100);
+   assert(arena->dirty == 0 && arena->dirty_top == 4096 - 216);
+   ptr3 = vlad_calloc(1, 1000);
+   for (i = 0; i < 1000; i++) assert(ptr3[i] == 0);
+   assert(arena->dirty == 1008 && arena->dirty_top == 4096 - 216);
+   vlad_free(ptr2);
+   ptr4 = vlad_calloc(1, 2900);
+   assert(ptr4 == ptr3 + 1008);
+   for (i = 0; i < 2900; i++) assert(ptr4[i] == 0);
+   vlad_free(ptr4);
+   vlad_free(ptr3);
+   fprintf(stderr, "> 5. with the index on, it is searched instead of the free list\n");
+   assert(vlad_set_index(1) == 0);
+   ptr2 = vlad_malloc_hint(100, VLAD_LONG);
+   assert(ptr2 == &memory[4096 - 216 + ALLOC_HEADER_SIZE]);
+   ptr3 = vlad_malloc_hint(50, VLAD_SHORT);
+   assert(ptr3 == &memory[ALLOC_HEADER_SIZE]);
+   fflush(stdout);
+   child = fork();
+   if (child == 0) {
+      arena->index_sizes[0] += 4;
+      vlad_malloc_hint(100, VLAD_LONG);
+      _exit(EXIT_SUCCESS);
+   }
+   assert(exitedWithFailure(child));
+   vlad_free(ptr3);
+   vlad_free(ptr2);
+   vlad_free(ptr1);
+   assert(arena->index_count == 1);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 1);
+   vlad_end();
+   vlad_init(2013);
+   fprintf(stderr, "passed!\n");
+   printLine();
+
+   fprintf(stderr, "Testing vlad_set_policy() ......\n");
+   fprintf(stderr, "> 1. bad policy or split sizes --> -1\n");
+   assert(vlad_set_policy(0, 32, 32) == -1);
+   assert(vlad_set_policy(VLAD_BEST_FIT, 8, 8) == -1);
+   assert(vlad_set_policy(VLAD_ADAPTIVE, 64, 32) == -1);
+   fprintf(stderr, "> 2. worst fit takes the end of memory[], not the 108 byte hole\n");
+   assert(vlad_set_policy(VLAD_WORST_FIT, 32, 0) == 0);
+   ptr1 = vlad_malloc(40);
+   ptr2 = vlad_malloc(100);
+   ptr3 = vlad_malloc(40);
+   vlad_free(ptr2);
+   ptr4 = vlad_malloc(50);
+   assert(ptr4 == ptr3 + 48);
+   vlad_free(ptr4);
+   fprintf(stderr, "> 3. best fit, split 64: vlad_malloc(50) takes all of the hole\n");
+   assert(vlad_set_policy(VLAD_BEST_FIT, 64, 0) == 0);
+   ptr4 = vlad_malloc(50);
+   assert(ptr4 == ptr2);
+   assert(vlad_usable_size(ptr4) == 100);
+   vlad_free(ptr4);
+   fprintf(stderr, "> 4. adaptive keeps its split threshold in range\n");
+   assert(vlad_set_policy(VLAD_ADAPTIVE, 16, 256) == 0);
+   for (i = 0; i < 3000; i++) {
+      ptr4 = vlad_malloc(1 + i % 200);
+      assert(ptr4 != NULL);
+      vlad_free(ptr4);
+   }
+   assert(arena->split_min >= 16 && arena->split_min <= 256);
+   assert(vlad_set_policy(VLAD_BEST_FIT, 32, 0) == 0);
+   vlad_free(ptr1);
+   vlad_free(ptr3);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 1);
+   fprintf(stderr, "> 5. adaptive: many small holes, most space in one block --> first fit\n");
+   vlad_end();
+   vlad_init(65536);
+   assert(vlad_set_policy(VLAD_ADAPTIVE, 32, 256) == 0);
+   assert(strategy == BEST_FIT);
+   for (i = 0; i < 400; i++) small[i] = vlad_malloc(40);
+   for (i = 0; i < 400; i += 2) vlad_free(small[i]);
+   for (i = 0; i < ADAPT_WINDOW + 1; i++) {
+      ptr4 = vlad_malloc(100);
+      assert(ptr4 != NULL);
+      vlad_free(ptr4);
+   }
+   assert(strategy == FIRST_FIT);
+   fprintf(stderr, "> 6. most free space back in the holes --> best fit\n");
+   ptr1 = vlad_malloc(40000);
+   assert(ptr1 != NULL);
+   for (i = 0; i < ADAPT_WINDOW + 1; i++) {
+      ptr4 = vlad_malloc(100);
+      assert(ptr4 != NULL);
+      vlad_free(ptr4);
+   }
+   assert(strategy == BEST_FIT);
+   assert(vlad_check(&report) == 0 && report.alloc_blocks == 201);
+   vlad_end();
+   vlad_init(2013);
+   fprintf(stderr, "passed!\n");
+   printLine();
+
+   fprintf(stderr, "Testing vlad_profile() ......\n");
+   fprintf(stderr, "> 1. sample every allocation, then free one of three\n");
+   vlad_profile(1);
+   ptr1 = vlad_malloc(100);
+   ptr2 = vlad_malloc(200);
+   ptr3 = vlad_malloc(300);
+   vlad_free(ptr2);
+
+   fprintf(stderr, "> 2. vlad_profile_dump() totals the two live blocks\n");
+   FILE *profile = tmpfile();
+   assert(profile != NULL);
+   assert(vlad_profile_dump(profile) == 0);
+   rewind(profile);
+   char header[100];
+   assert(fgets(header, sizeof(header), profile) != NULL);
+   assert(strcmp(header, "heap profile: 2: 400 [2: 400] @ heapprofile\n") == 0);
+   fclose(profile);
+   vlad_profile(0);
+   vlad_free(ptr1);
+   vlad_free(ptr3);
+   fprintf(stderr, "passed!\n");
+   printLine();
+
+   fprintf(stderr, "Testing vlad_set_decay() & vlad_purge() ......\n");
+   fprintf(stderr, "> 1. a freed 256KB block between two used ones (1MB heap)\n");
+   vlad_end();
+   vlad_init(1 << 20);
+   size_t page = sysconf(_SC_PAGESIZE);
+   assert(vlad_set_decay(1, 0) == 0);
+   ptr1 = vlad_malloc(100);
+   ptr2 = vlad_malloc(256 << 10);
+   ptr3 = vlad_malloc(100);
+   memset(ptr2, 3, 256 << 10);
+   vlad_free(ptr2);
+   usleep(50000);
+   fprintf(stderr, "> 2. its pages past the header are given back, and read as 0\n");
+   u_int32_t purged = vlad_purge((u_int32_t) -1);
+   assert(purged % page == 0);
+   assert(purged >= (256 << 10) - 2 * page && purged <= (256 << 10));
+   assert(ptr2[-ALLOC_HEADER_SIZE + FREE_HEADER_SIZE] == 3);
+   assert(ptr2[page] == 0 && ptr2[(256 << 10) - page - 1] == 0);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 2);
+   assert(vlad_purge((u_int32_t) -1) == 0);
+   fprintf(stderr, "> 3. not before they have been idle for the decay time\n");
+   assert(vlad_set_decay(3600000, 0) == 0);
+   ptr2 = vlad_malloc(256 << 10);
+   memset(ptr2, 3, 256 << 10);
+   vlad_free(ptr2);
+   assert(vlad_purge((u_int32_t) -1) == 0);
+   assert(ptr2[page] == 3);
+   fprintf(stderr, "> 4. the background thread gives them back by itself\n");
+   assert(vlad_set_decay(1, 5) == 0);
+   for (i = 0; i < 5000 && ptr2[page] != 0; i++) usleep(1000);
+   assert(ptr2[page] == 0);
+   assert(vlad_set_decay(0, 0) == 0);
+   vlad_free(ptr1);
+   vlad_free(ptr3);
+   assert(vlad_check(&report) == 0);
+   assert(report.free_blocks == 1);
+   vlad_end();
+   vlad_init(2013);
+   fprintf(stderr, "passed!\n");
+   printLine();
+
    fprintf(stderr, "Final Test: vlad_end()\n");
+   fprintf(stderr, "> with one 60 byte block, one 72 byte handle block and one\n");
+   fprintf(stderr, ">    huge block of 100000 bytes leaked\n");
+   FILE *leaks = tmpfile();
+   assert(leaks != NULL);
+   vlad_leak_report(leaks);
+   ptr1 = vlad_malloc(50);
+   h1 = vlad_handle_alloc(60);
+   assert(h1 != 0);
+   vlad_set_mmap_threshold(4096);
+   ptr2 = vlad_malloc(100000);
+   assert(ptr2 != NULL);
+   size_t length = (HUGE_HEADER_SIZE + 100000 + page - 1) & ~(page - 1);
    vlad_end();
    assert(memory == NULL);
+   vlad_leak_report(NULL);
+   vlad_set_mmap_threshold(0);
+   rewind(leaks);
+   char expected[100];
+   sprintf(expected, "vlad_end: 3 blocks (%zu bytes) still allocated\n", 132 + length);
+   assert(fgets(header, sizeof(header), leaks) != NULL);
+   assert(strcmp(header, expected) == 0);
+   assert(fgets(header, sizeof(header), leaks) != NULL);
+   assert(strcmp(header, "  32-63 bytes: 1 blocks, 60 bytes\n") == 0);
+   assert(fgets(header, sizeof(header), leaks) != NULL);
+   assert(strcmp(header, "    arena 0 offset 0 size 60\n") == 0);
+   assert(fgets(header, sizeof(header), leaks) != NULL);
+   assert(strcmp(header, "  64-127 bytes: 1 blocks, 72 bytes\n") == 0);
+   assert(fgets(header, sizeof(header), leaks) != NULL);
+   assert(strcmp(header, "    arena 0 offset 60 size 72 handle\n") == 0);
+   sprintf(expected, "  %llu-%llu bytes: 1 blocks, %zu bytes\n", 1ULL << sizeClass(length),
+           (2ULL << sizeClass(length)) - 1, length);
+   assert(fgets(header, sizeof(header), leaks) != NULL);
+   assert(strcmp(header, expected) == 0);
+   sprintf(expected, "    mmap %p size %zu\n", ptr2, length);
+   assert(fgets(header, sizeof(header), leaks) != NULL);
+   assert(strcmp(header, expected) == 0);
+   fclose(leaks);
    fprintf(stderr, "passed!\n");
    printLine();
 }
 
 void printLine(void) {
    fprintf(stderr, "------------------------------------------\n\n");
-}
\ No newline at end of file
+}
+
+// waits for a child that was expected to report an error and exit
+int exitedWithFailure(pid_t child) {
+   int status;
+   return waitpid(child, &status, 0) == child && WIFEXITED(status)
+          && WEXITSTATUS(status) == EXIT_FAILURE;
+}
+
+// thread body: frees a block that the main thread allocated
+void *freeRemotely(void *object) {
+   vlad_free_remote(object);
+   return NULL;
+}
+
+// thread body: allocates and frees small blocks, checking that nothing
+// else writes over them
+void *churn(void *unused) {
+   byte *held[8] = {NULL};
+   int i;
+   for (i = 0; i < 20000; i++) {
+      int slot = (i * 7) % 8;
+      if (held[slot] != NULL) {
+         u_int32_t n = 1 + (held[slot][0] % 64);
+         u_int32_t j;
+         for (j = 0; j < n; j++) assert(held[slot][j] == (byte) (n - 1));
+         vlad_free(held[slot]);
+      }
+      u_int32_t n = 1 + (i * 13) % 64;
+      held[slot] = vlad_malloc(n);
+      if (held[slot] != NULL) memset(held[slot], n - 1, n);
+   }
+   for (i = 0; i < 8; i++) {
+      if (held[i] != NULL) vlad_free(held[i]);
+   }
+   return NULL;
+}
+
+#ifdef INDEX_SIMD
+// each vector kernel this CPU can run must pick the entry scanBestFit does
+void compareBestFits(const vsize_t *sizes, u_int32_t count, vsize_t n) {
+   int expected = scanBestFit(sizes, count, n);
+   if (__builtin_cpu_supports("sse4.1")) {
+      assert(bestFitSSE41(sizes, count, n) == expected);
+   }
+   if (__builtin_cpu_supports("avx2")) {
+      assert(bestFitAVX2(sizes, count, n) == expected);
+   }
+}
+#endif
\ No newline at end of file
@@ -6,113 +6,466 @@
 // Modified by John Shepherd, August 2015
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <time.h>
+#include <limits.h>
 
 #include "allocator.h"
 
 #define MEMORY_SIZE 4096
+#define BATCH_BLOCK (1 << 20)  // bytes of script read at a time in batch mode
+#define MIN_VARS    64         // initial size of the variable table
+#define MAX_VARS    (1 << 24)  // largest variable number + 26
 
 typedef unsigned char Byte;
 
+// the pointer "variable"s: a..z are 0..25, and numbered ones follow them
+typedef struct {
+   void **ptr;      // ptr[i] is variable i (NULL if unallocated)
+   int size;        // # entries in ptr[]
+} Vars;
+
+// what happened in a run
+typedef struct {
+   long lines;      // # lines read
+   long allocs;     // # successful +, c, a commands (and objects from b)
+   long reallocs;   // # successful r commands
+   long frees;      // # successful - commands (and objects from f)
+   long writes;     // # successful * commands
+   long failures;   // # commands (or batch objects) that could not be done
+   long invalid;    // # lines that are not commands
+   struct timespec mark;   // time of the last t command (or start)
+   long markOps;            // # ops done before the last t command
+} Counts;
+
+static int runBatch(Vars *vars);
+static int policyNumber(char *name);
+static int command(char *line, Vars *vars, Counts *counts, int verbose);
+static void showHelp(void);
+static void checkpoint(char *label, Counts *counts);
+static long opCount(Counts *counts);
+static double since(struct timespec *from);
+static void **varSlot(Vars *vars, int var);
+static char *varName(int var);
+static char *scanVar(char *s, int *var);
+static char *scanInt(char *s, int *val);
+
 // Main program: reads commands from stdin until EOF
-// Assumes we have 26 pointer variables called a..z
+// Has a table of pointer variables, called a..z and 0, 1, 2, ...
 // Allows us to perform operations on those variables
 // Possible commands:
-//    + X N  ... allocate N bytes and assign to X
-//    - X    ... free memory associated with X
-//    * X N  ... store N in memory referenced by X
-//    !      ... show vlad statistics
-//    ?      ... show this help message
-//    q      ... quit this program (^D also works)
-// where X is a single letter in a..z
-//       N is an integer value
+//    + X N    ... allocate N bytes and assign to X
+//    - X      ... free memory associated with X
+//    * X N    ... store N in memory referenced by X
+//    r X N    ... resize X to N bytes (vlad_realloc)
+//    c X N    ... allocate N zeroed bytes and assign to X
+//    a X A N  ... allocate N bytes aligned to A and assign to X
+//    b X Y N  ... allocate N bytes to each of the variables X..Y
+//    f X Y    ... free each of the variables X..Y
+//    t [L]    ... timing checkpoint, labelled L
+//    !        ... show vlad statistics
+//    ?        ... show this help message
+//    q        ... quit this program (^D also works)
+// where X, Y are a single letter in a..z or a variable number >= 0
+//       N, A are integer values (0 to INT_MAX)
+//
+// With -b (batch mode) the script is read from stdin in large blocks, and
+// nothing is echoed; only a summary with timings is printed at the end.
+// With -m SIZE, the allocator manages SIZE bytes rather than MEMORY_SIZE.
+// With -p POLICY (best, worst, random, first or adaptive), blocks are
+// placed by that policy; -s SPLIT or -s SPLIT,MAX sets the smallest
+// remainder a split may leave (and, for adaptive, how large it may grow).
 
 int main(int argc, char *argv[])
 {
    char line[BUFSIZ]; // input line
-   char var;          // which "variable"
-   int  val;          // value of N
-   void *ptr[26];     // array of pointer "variable"s
+   Vars vars;         // pointer "variable"s
+   Counts counts = { 0 };
    int  quiet = 0;    // flag to reduce output "noise"
+   int  batch = 0;    // flag for batch mode
+   int  size = MEMORY_SIZE;
+   int  policy = VLAD_BEST_FIT;
+   int  split = 32, splitMax = 32;
 
-   setbuf(stdout, NULL); // don't buffer stdout
-
-   // sort out quiet-ness
+   // sort out quiet-ness, batch mode and memory size
    if (argc > 2 && argv[2][0] == 'q') quiet = 1;
+   int i;
+   for (i = 1; i < argc; i++) {
+      if (strcmp(argv[i], "-b") == 0) batch = 1;
+      if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) size = atoi(argv[++i]);
+      if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) policy = policyNumber(argv[++i]);
+      if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+         if (sscanf(argv[++i], "%d,%d", &split, &splitMax) < 2) splitMax = split;
+      }
+   }
+   if (size <= 0) {
+      fprintf(stderr, "Invalid memory size\n");
+      return EXIT_FAILURE;
+   }
 
    // initialise pointer variables
-   int i;
-   for (i = 'a'; i <= 'z'; i++) {
-      ptr[i-'a'] = NULL;
+   vars.size = MIN_VARS;
+   vars.ptr = calloc(vars.size, sizeof(void *));
+   if (vars.ptr == NULL) {
+      fprintf(stderr, "Not enough memory for variables\n");
+      return EXIT_FAILURE;
    }
 
    // start the allocator
-   vlad_init(MEMORY_SIZE);
+   vlad_init(size);
+   if (vlad_set_policy(policy, split, splitMax) != 0) {
+      fprintf(stderr, "Invalid placement policy or split size\n");
+      return EXIT_FAILURE;
+   }
+
+   if (batch) return runBatch(&vars);
+
+   setbuf(stdout, NULL); // don't buffer stdout
 
    // main loop ... read command and carry it out
+   clock_gettime(CLOCK_MONOTONIC, &counts.mark);
    if (isatty(0) && !quiet) printf("> ");
    while (fgets(line, BUFSIZ, stdin) != NULL) {
       // if reading from a file, echo the command
       if (!isatty(0)) printf("%s\n",line);
-      // do some cheap-and-nasty parsing using sscanf
-      if (sscanf(line, "+ %[a-z] %d", &var, &val) == 2) {
-         // set a pointer variable using vlad_malloc()
-         if (ptr[var-'a'] != NULL)
+      line[strcspn(line, "\n")] = '\0';
+      counts.lines++;
+      if (command(line, &vars, &counts, !quiet)) break;
+      if (isatty(0) && !quiet) printf("> ");
+   }
+   return EXIT_SUCCESS;
+}
+
+
+// Batch mode: run the whole script from stdin, then print a summary
+// The script is read BATCH_BLOCK bytes at a time; a line cut off at the
+// end of a block is moved to the front of the buffer before the next read
+static int runBatch(Vars *vars)
+{
+   char *buf = malloc(BATCH_BLOCK + 1);
+   Counts counts = { 0 };
+   size_t have = 0;   // # bytes in buf not yet run
+   int done = 0;
+   struct timespec start;
+
+   if (buf == NULL) {
+      fprintf(stderr, "Not enough memory for batch mode\n");
+      return EXIT_FAILURE;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   counts.mark = start;
+   while (!done) {
+      size_t got = fread(buf + have, 1, BATCH_BLOCK - have, stdin);
+      have += got;
+      if (got == 0) {
+         // no more input: run whatever is left as a final line
+         if (have == 0) break;
+         buf[have++] = '\n';
+      }
+
+      char *line = buf;
+      char *stop = buf + have;
+      char *nl;
+      while (!done && (nl = memchr(line, '\n', stop - line)) != NULL) {
+         *nl = '\0';
+         counts.lines++;
+         done = command(line, vars, &counts, 0);
+         line = nl + 1;
+      }
+      if (line == buf && have == BATCH_BLOCK) {
+         fprintf(stderr, "Line %ld is too long\n", counts.lines + 1);
+         break;
+      }
+      have = stop - line;
+      memmove(buf, line, have);
+   }
+   double secs = since(&start);
+   free(buf);
+
+   long ops = opCount(&counts);
+   printf("lines %ld: %ld allocs, %ld reallocs, %ld frees, %ld writes, "
+          "%ld failed, %ld invalid\n",
+          counts.lines, counts.allocs, counts.reallocs, counts.frees,
+          counts.writes, counts.failures, counts.invalid);
+   printf("time %.6f sec, %.0f ops/sec\n", secs, secs > 0 ? ops / secs : 0.0);
+   return EXIT_SUCCESS;
+}
+
+// The VLAD_..._FIT policy called name (e.g. "best"), or -1 if none is
+static int policyNumber(char *name)
+{
+   static char *names[] = { "best", "worst", "random", "first", "adaptive" };
+   int i;
+   for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+      if (strcmp(name, names[i]) == 0) return VLAD_BEST_FIT + i;
+   }
+   return -1;
+}
+
+// Run one command; returns 1 if it was q (quit)
+// If verbose, what was done is printed, and problems go to stderr;
+// either way they are counted
+static int command(char *line, Vars *vars, Counts *counts, int verbose)
+{
+   int var, last, val, align;
+   void **slot;
+   char *s = line;
+   char op;
+
+   while (*s == ' ' || *s == '\t') s++;
+   op = *s++;
+   switch (op) {
+   case '+':
+   case 'c':
+      if ((s = scanVar(s, &var)) == NULL || scanInt(s, &val) == NULL) break;
+      if ((slot = varSlot(vars, var)) == NULL || *slot != NULL) {
+         if (verbose)
             fprintf(stderr, "Attempt to alloc over already allocated pointer\n");
-         else {
-            Byte *b = vlad_malloc(val);
-            if (b == NULL)
-               fprintf(stderr, "Failed to allocate %d bytes for ptr[%c]\n", val, var);
-            else {
-               ptr[var-'a'] = b;
-               if (!quiet) printf("ptr[%c] allocated %p\n", var, b);
-            }
-         }
+         counts->failures++;
+      }
+      else if ((*slot = (op == '+') ? vlad_malloc(val)
+                                    : vlad_calloc(1, val)) == NULL) {
+         if (verbose)
+            fprintf(stderr, "Failed to allocate %d bytes for ptr[%s]\n",
+                    val, varName(var));
+         counts->failures++;
+      }
+      else {
+         if (verbose) printf("ptr[%s] allocated %p\n", varName(var), *slot);
+         counts->allocs++;
+      }
+      return 0;
+   case 'a':
+      if ((s = scanVar(s, &var)) == NULL || (s = scanInt(s, &align)) == NULL
+          || scanInt(s, &val) == NULL) break;
+      if ((slot = varSlot(vars, var)) == NULL || *slot != NULL) {
+         if (verbose)
+            fprintf(stderr, "Attempt to alloc over already allocated pointer\n");
+         counts->failures++;
+      }
+      else if ((*slot = vlad_aligned_alloc(align, val)) == NULL) {
+         if (verbose)
+            fprintf(stderr, "Failed to allocate %d bytes aligned to %d for ptr[%s]\n",
+                    val, align, varName(var));
+         counts->failures++;
+      }
+      else {
+         if (verbose) printf("ptr[%s] allocated %p\n", varName(var), *slot);
+         counts->allocs++;
       }
-      else if (sscanf(line, "- %[a-z]", &var) == 1) {
-         // free memory allocated by Vlad
-         if (ptr[var-'a'] == NULL)
-            fprintf(stderr, "Attempt to free null pointer\n");
+      return 0;
+   case 'r':
+      if ((s = scanVar(s, &var)) == NULL || scanInt(s, &val) == NULL) break;
+      if ((slot = varSlot(vars, var)) == NULL || *slot == NULL || val <= 0) {
+         if (verbose)
+            fprintf(stderr, "Attempt to resize unallocated pointer\n");
+         counts->failures++;
+      }
+      else {
+         void *p = vlad_realloc(*slot, val);
+         if (p == NULL) {
+            if (verbose)
+               fprintf(stderr, "Failed to resize ptr[%s] to %d bytes\n",
+                       varName(var), val);
+            counts->failures++;
+         }
          else {
-            Byte *b = ptr[var-'a'];
-            if (!quiet) printf("Deallocating memory at %p\n", b);
-            vlad_free(b);
-            ptr[var-'a'] = NULL;
+            if (verbose) printf("ptr[%s] resized %p -> %p\n", varName(var), *slot, p);
+            *slot = p;
+            counts->reallocs++;
          }
       }
-      else if (sscanf(line, "* %[a-z] %d", &var, &val) == 2) {
-         // write something into an allocated piece of memory
-         if (ptr[var-'a'] == NULL)
-            fprintf(stderr, "Attempt to write via unallocated pointer\n");
+      return 0;
+   case '-':
+      if (scanVar(s, &var) == NULL) break;
+      if ((slot = varSlot(vars, var)) == NULL || *slot == NULL) {
+         if (verbose) fprintf(stderr, "Attempt to free null pointer\n");
+         counts->failures++;
+      }
+      else {
+         if (verbose) printf("Deallocating memory at %p\n", *slot);
+         vlad_free(*slot);
+         *slot = NULL;
+         counts->frees++;
+      }
+      return 0;
+   case 'b':
+   case 'f':
+      if ((s = scanVar(s, &var)) == NULL || (s = scanVar(s, &last)) == NULL
+          || (op == 'b' && scanInt(s, &val) == NULL)) break;
+      if (last < var || varSlot(vars, last) == NULL) {
+         if (verbose) fprintf(stderr, "Invalid variable range\n");
+         counts->failures++;
+         return 0;
+      }
+      long done = 0, failed = 0;
+      for (; var <= last; var++) {
+         slot = &vars->ptr[var];
+         if (op == 'b') {
+            if (*slot != NULL || (*slot = vlad_malloc(val)) == NULL)
+               failed++;
+            else
+               done++;
+         }
+         else if (*slot == NULL)
+            failed++;
          else {
-            Byte *x = ptr[var-'a'];
-            *x = (Byte)val;
-            if (!quiet) printf("Memory at %p assigned %d\n", x, *x);
+            vlad_free(*slot);
+            *slot = NULL;
+            done++;
          }
       }
-      else if (line[0] == '?') {
-         printf("Possible commands:\n");
-         printf("+ X N  ... allocate N bytes and assign to X\n");
-         printf("- X    ... free memory associated with X\n");
-         printf("* X N  ... store N in memory referenced by X\n");
-         printf("!      ... show Vlad statistics\n");
-         printf("?      ... show this help message\n");
-         printf("q      ... quit this program (^D also works)\n");
-         printf("       where X is a single letter in a..z\n");
-         printf("       and   N is an integer value\n");
-      }
-      else if (line[0] == '!') {
-         vlad_stats();
-      }
-      else if (line[0] == 'q') {
-         break;
+      if (op == 'b') counts->allocs += done; else counts->frees += done;
+      counts->failures += failed;
+      if (verbose)
+         printf("%s %ld objects, %ld failed\n",
+                op == 'b' ? "Allocated" : "Freed", done, failed);
+      return 0;
+   case '*':
+      if ((s = scanVar(s, &var)) == NULL || scanInt(s, &val) == NULL) break;
+      if ((slot = varSlot(vars, var)) == NULL || *slot == NULL) {
+         if (verbose) fprintf(stderr, "Attempt to write via unallocated pointer\n");
+         counts->failures++;
       }
       else {
-         printf("Invalid command\n");
+         Byte *x = *slot;
+         *x = (Byte)val;
+         if (verbose) printf("Memory at %p assigned %d\n", x, *x);
+         counts->writes++;
       }
-      if (isatty(0) && !quiet) printf("> ");
+      return 0;
+   case 't':
+      while (*s == ' ' || *s == '\t') s++;
+      s[strcspn(s, "\r")] = '\0';
+      checkpoint(s, counts);
+      return 0;
+   case '?':
+      if (verbose) showHelp();
+      return 0;
+   case '!':
+      fflush(stdout);
+      vlad_stats();
+      return 0;
+   case 'q':
+      return 1;
+   case '\0':
+   case '\r':
+      if (!verbose) return 0;
+      break;
    }
-   return EXIT_SUCCESS;
+   if (verbose) printf("Invalid command\n");
+   counts->invalid++;
+   return 0;
+}
+
+static void showHelp(void)
+{
+   printf("Possible commands:\n");
+   printf("+ X N    ... allocate N bytes and assign to X\n");
+   printf("- X      ... free memory associated with X\n");
+   printf("* X N    ... store N in memory referenced by X\n");
+   printf("r X N    ... resize X to N bytes\n");
+   printf("c X N    ... allocate N zeroed bytes and assign to X\n");
+   printf("a X A N  ... allocate N bytes aligned to A and assign to X\n");
+   printf("b X Y N  ... allocate N bytes to each of the variables X..Y\n");
+   printf("f X Y    ... free each of the variables X..Y\n");
+   printf("t [L]    ... print time and ops since the last checkpoint\n");
+   printf("!        ... show Vlad statistics\n");
+   printf("?        ... show this help message\n");
+   printf("q        ... quit this program (^D also works)\n");
+   printf("         where X, Y are a single letter in a..z or a number >= 0\n");
+   printf("         and   N, A are integer values (0 to INT_MAX)\n");
+}
+
+// Timing checkpoint: time and ops since the previous one (or the start)
+static void checkpoint(char *label, Counts *counts)
+{
+   double secs = since(&counts->mark);
+   long ops = opCount(counts) - counts->markOps;
+
+   printf("t %s%s%.6f sec, %ld ops, %.0f ops/sec\n", label,
+          *label != '\0' ? ": " : "", secs, ops, secs > 0 ? ops / secs : 0.0);
+   clock_gettime(CLOCK_MONOTONIC, &counts->mark);
+   counts->markOps = opCount(counts);
+}
+
+static long opCount(Counts *counts)
+{
+   return counts->allocs + counts->reallocs + counts->frees + counts->writes;
+}
+
+// seconds elapsed since *from
+static double since(struct timespec *from)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - from->tv_sec) + (now.tv_nsec - from->tv_nsec) / 1e9;
+}
+
+// Where variable var is kept, growing the table if needed;
+// returns NULL if var is negative or too big for the table
+static void **varSlot(Vars *vars, int var)
+{
+   if (var < 0 || var >= MAX_VARS) return NULL;
+   if (var >= vars->size) {
+      int size = vars->size;
+      while (size <= var) size *= 2;
+      void **ptr = realloc(vars->ptr, size * sizeof(void *));
+      if (ptr == NULL) return NULL;
+      memset(ptr + vars->size, 0, (size - vars->size) * sizeof(void *));
+      vars->ptr = ptr;
+      vars->size = size;
+   }
+   return &vars->ptr[var];
 }
 
+// Printable name of a variable
+static char *varName(int var)
+{
+   static char name[16];
+   if (var < 26)
+      sprintf(name, "%c", 'a' + var);
+   else
+      sprintf(name, "%d", var - 26);
+   return name;
+}
+
+// Scan a variable: a..z, or a number; returns NULL if there is none
+static char *scanVar(char *s, int *var)
+{
+   while (*s == ' ' || *s == '\t') s++;
+   if (*s >= 'a' && *s <= 'z') {
+      *var = *s - 'a';
+      return s + 1;
+   }
+   if (*s < '0' || *s > '9') return NULL;
+   // stop adding digits once past MAX_VARS, so that n cannot overflow
+   int n = 0;
+   while (*s >= '0' && *s <= '9') {
+      if (n < MAX_VARS) n = 10*n + (*s - '0');
+      s++;
+   }
+   if (n >= MAX_VARS - 26) return NULL;
+   *var = n + 26;
+   return s;
+}
+
+// Scan a non-negative integer value; returns NULL if there is none,
+// or if it is bigger than INT_MAX
+static char *scanInt(char *s, int *val)
+{
+   int n = 0;
+
+   while (*s == ' ' || *s == '\t') s++;
+   if (*s < '0' || *s > '9') return NULL;
+   while (*s >= '0' && *s <= '9') {
+      if (n > (INT_MAX - (*s - '0')) / 10) return NULL;
+      n = 10*n + (*s++ - '0');
+   }
+   *val = n;
+   return s;
+}
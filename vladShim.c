@@ -0,0 +1,316 @@
+//
+//  Vlad as the process's malloc
+//  vladShim.c ... LD_PRELOAD shim for the standard malloc family
+//
+//  make libvlad.so
+//  LD_PRELOAD=./libvlad.so program ...
+//
+//  Environment (all optional):
+//    VLAD_ARENA_SIZE  bytes in each arena (default 256MB, at most 1GB)
+//    VLAD_ARENAS      number of arenas (default 0 = one per CPU core)
+//    VLAD_LAZY        vlad_set_lazy budget (default 0)
+//    VLAD_PROFILE     vlad_profile sampling rate (default 0 = off)
+//    VLAD_MMAP_THRESHOLD  vlad_set_mmap_threshold (default 128KB, as glibc)
+//
+
+/*
+
+Vlad is started by the first call into the shim rather than by vlad_init.
+
+malloc must return memory aligned for any type (16 bytes on x86-64), so
+the shim sets Vlad's granule to 16 (vlad_set_granule): every block is then
+a multiple of 16 bytes with its payload on a 16 byte boundary, and plain
+requests go straight to vlad_malloc. Only larger alignments need
+vlad_aligned_alloc.
+
+If Vlad cannot map its arenas it is never started, and every request
+goes to the next malloc.
+
+Pointers that Vlad does not own (vlad_owns) are passed on to the next
+malloc in the search order (normally glibc's). That is where requests go
+that Vlad cannot satisfy, e.g. because the arenas are full or the request
+is over 4GB. (Requests of VLAD_MMAP_THRESHOLD bytes or more do not use the
+arenas at all: Vlad maps them one by one. Other requests as big as an
+arena are not even tried.) It also covers memory the program got before
+the shim was loaded.
+
+calloc goes to vlad_calloc, which knows which bytes are zero already,
+and only clears the blocks it gets from elsewhere.
+
+While the shim is starting Vlad, or is already inside Vlad on the same
+thread (dlsym, backtrace and stdio may all call malloc), requests are
+served from a small static buffer and never freed.
+
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <dlfcn.h>
+#include "allocator.h"
+
+#define SHIM_ALIGN         16           // malloc's alignment on x86-64
+#define DEFAULT_ARENA_SIZE (1u << 28)
+#define MAX_ARENA_SIZE     (1u << 30)   // largest power of two Vlad can manage
+#define DEFAULT_MMAP_THRESHOLD (128u << 10)
+#define BOOTSTRAP_SIZE     (1 << 16)    // static buffer for re-entrant calls
+
+typedef unsigned char byte;
+
+// the next allocator's functions, found by startVlad
+static struct {
+    void *(*malloc)(size_t);
+    void (*free)(void *);
+    void *(*realloc)(void *, size_t);
+    int (*posix_memalign)(void **, size_t, size_t);
+    size_t (*malloc_usable_size)(void *);
+} next;
+
+static pthread_once_t started = PTHREAD_ONCE_INIT;
+static _Thread_local int inside;     // TRUE while this thread is in the shim
+
+static size_t arena_size;           // bytes in each arena (0 = Vlad not started)
+static size_t mmap_threshold;       // as given to vlad_set_mmap_threshold
+
+static byte bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(SHIM_ALIGN)));
+static _Atomic size_t bootstrap_used;
+
+static void startVlad(void);
+static void *allocate(size_t alignment, size_t n);
+static int fits(size_t n);
+static void *bootstrapAlloc(size_t alignment, size_t n);
+static int isBootstrap(void *object);
+static size_t bootstrapSize(void *object);
+static size_t envSize(const char *name, size_t otherwise);
+
+void *malloc(size_t n)
+{
+    return allocate(SHIM_ALIGN, n);
+}
+
+void free(void *object)
+{
+    if(object == NULL || isBootstrap(object)) return;
+
+    if(vlad_owns(object)){
+        int wasInside = inside;
+        inside = 1;
+        vlad_free(object);
+        inside = wasInside;
+    } else if(next.free != NULL){
+        next.free(object);
+    }
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    if(size != 0 && nmemb > SIZE_MAX / size){
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t n = nmemb * size;
+
+    if(!inside){
+        inside = 1;
+        pthread_once(&started, startVlad);
+        void *object = fits(n) ? vlad_calloc(1, n) : NULL;
+        inside = 0;
+        if(object != NULL) return object;
+    }
+
+    // bootstrap[] or the next malloc
+    void *object = allocate(SHIM_ALIGN, n);
+    if(object != NULL){
+        memset(object, 0, n);
+    }
+    return object;
+}
+
+void *realloc(void *object, size_t n)
+{
+    if(object == NULL) return malloc(n);
+    if(n == 0){
+        free(object);
+        return NULL;
+    }
+
+    size_t oldSize;
+    if(isBootstrap(object)){
+        oldSize = bootstrapSize(object);
+    } else if(!vlad_owns(object)){
+        return next.realloc(object, n);
+    } else {
+        if(!inside && fits(n)){
+            inside = 1;
+            void *moved = vlad_realloc(object, n);
+            inside = 0;
+            if(moved != NULL) return moved;
+        }
+        oldSize = vlad_usable_size(object);
+    }
+
+    // Vlad is full (or this is a bootstrap block): copy it elsewhere
+    void *moved = malloc(n);
+    if(moved == NULL) return NULL;
+    memcpy(moved, object, oldSize < n ? oldSize : n);
+    free(object);
+    return moved;
+}
+
+int posix_memalign(void **result, size_t alignment, size_t n)
+{
+    if(alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0){
+        return EINVAL;
+    }
+    void *object = allocate(alignment, n);
+    if(object == NULL) return ENOMEM;
+    *result = object;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t n)
+{
+    if(alignment == 0 || (alignment & (alignment - 1)) != 0){
+        errno = EINVAL;
+        return NULL;
+    }
+    return allocate(alignment, n);
+}
+
+void *memalign(size_t alignment, size_t n)
+{
+    return aligned_alloc(alignment, n);
+}
+
+void *valloc(size_t n)
+{
+    return allocate(sysconf(_SC_PAGESIZE), n);
+}
+
+void *pvalloc(size_t n)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return allocate(page, (n + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *object)
+{
+    if(object == NULL) return 0;
+    if(isBootstrap(object)) return bootstrapSize(object);
+    if(vlad_owns(object)) return vlad_usable_size(object);
+    return next.malloc_usable_size != NULL ? next.malloc_usable_size(object) : 0;
+}
+
+// Input: alignment - a power of two; n - number of bytes requested
+// Output: a block of n bytes at a multiple of alignment (and of
+//         SHIM_ALIGN), or NULL with errno set
+
+static void *allocate(size_t alignment, size_t n)
+{
+    if(alignment < SHIM_ALIGN){
+        alignment = SHIM_ALIGN;
+    }
+    if(inside) return bootstrapAlloc(alignment, n);
+
+    inside = 1;
+    pthread_once(&started, startVlad);
+    void *object = NULL;
+    if(fits(n) && alignment <= MAX_ARENA_SIZE){
+        object = (alignment == SHIM_ALIGN) ? vlad_malloc(n)
+                                           : vlad_aligned_alloc(alignment, n);
+    }
+    if(object == NULL && next.posix_memalign != NULL
+       && next.posix_memalign(&object, alignment, n) != 0){
+        object = NULL;
+    }
+    inside = 0;
+
+    if(object == NULL){
+        errno = ENOMEM;
+    }
+    return object;
+}
+
+// Output: TRUE if Vlad may be able to hold n bytes: in an arena, or in a
+//         mapping of their own (any larger request would fail, or worse,
+//         be more than Vlad's sizes can hold)
+// Precondition: startVlad has run
+
+static int fits(size_t n)
+{
+    if(n > UINT32_MAX) return 0;
+    return n < arena_size || (mmap_threshold > 0 && n >= mmap_threshold);
+}
+
+// Postcondition: Vlad has been started as the environment asks,
+//                and next holds the functions it is in front of
+
+static void startVlad(void)
+{
+    next.malloc = dlsym(RTLD_NEXT, "malloc");
+    next.free = dlsym(RTLD_NEXT, "free");
+    next.realloc = dlsym(RTLD_NEXT, "realloc");
+    next.posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    next.malloc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+
+    size_t size = envSize("VLAD_ARENA_SIZE", DEFAULT_ARENA_SIZE);
+    if(size > MAX_ARENA_SIZE){
+        size = MAX_ARENA_SIZE;
+    }
+    vlad_set_granule(SHIM_ALIGN);
+    if(vlad_try_init_arenas(size, envSize("VLAD_ARENAS", 0)) != 0) return;
+    vlad_set_lazy(envSize("VLAD_LAZY", 0));
+    vlad_profile(envSize("VLAD_PROFILE", 0));
+    mmap_threshold = envSize("VLAD_MMAP_THRESHOLD", DEFAULT_MMAP_THRESHOLD);
+    if(mmap_threshold > UINT32_MAX){
+        mmap_threshold = 0;
+    }
+    vlad_set_mmap_threshold(mmap_threshold);
+    arena_size = size;
+}
+
+// Output: a block from bootstrap[], or NULL if there is no room left
+//
+// Each block is preceded by SHIM_ALIGN bytes holding its size (see
+// bootstrapSize); alignment beyond SHIM_ALIGN is not supported here.
+
+static void *bootstrapAlloc(size_t alignment, size_t n)
+{
+    size_t need = SHIM_ALIGN + ((n + SHIM_ALIGN - 1) & ~(size_t) (SHIM_ALIGN - 1));
+    if(alignment > SHIM_ALIGN || n > BOOTSTRAP_SIZE){
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t used = atomic_fetch_add(&bootstrap_used, need);
+    if(used + need > BOOTSTRAP_SIZE){
+        errno = ENOMEM;
+        return NULL;
+    }
+    *(size_t *) &bootstrap[used] = n;
+    return &bootstrap[used + SHIM_ALIGN];
+}
+
+static int isBootstrap(void *object)
+{
+    return (byte *) object >= bootstrap && (byte *) object < bootstrap + BOOTSTRAP_SIZE;
+}
+
+static size_t bootstrapSize(void *object)
+{
+    return *(size_t *) ((byte *) object - SHIM_ALIGN);
+}
+
+// Output: the value of environment variable "name", or otherwise if unset
+
+static size_t envSize(const char *name, size_t otherwise)
+{
+    const char *value = getenv(name);
+    if(value == NULL || *value == '\0') return otherwise;
+    return strtoull(value, NULL, 0);
+}
@@ -0,0 +1,439 @@
+//
+//  Recording a program's heap use as a vlad script
+//  vladTrace.c ... LD_PRELOAD tracer for the standard malloc family
+//
+//  make libvladtrace.so
+//  VLAD_TRACE=out LD_PRELOAD=$PWD/libvladtrace.so program ...
+//  ./vlad -b -m SIZE -p POLICY < out.PID
+//
+//  Environment:
+//    VLAD_TRACE  file name prefix; each process writes to PREFIX.PID
+//                (nothing is recorded if it is unset)
+//
+
+/*
+
+Every call is passed straight on to glibc's own functions (__libc_malloc
+and friends, which never call back into the tracer), so the program runs
+on the allocator it normally has and only the requests are recorded, in
+the script language of vlad.c:
+
+    malloc(n)               + V n
+    calloc(m, n)            c V m*n
+    realloc(p, n)           r V n    (+ V n if p is NULL, - V if n is 0)
+    posix_memalign(r, a, n) a V a n  (and memalign, aligned_alloc)
+    free(p)                 - V
+
+V is the number of a pointer variable. Each pointer that is live in the
+program has one, and a number is reused once its block has been freed,
+so that vlad's table of variables stays no larger than the program's
+heap. Failed requests, requests over INT_MAX bytes (which vlad cannot
+read), and frees and reallocs of pointers never seen (e.g. from before
+the tracer was loaded) are left out. Calls made while the same thread is already inside
+the tracer are not recorded either.
+
+A child process starts a trace of its own, with no variables. Lines are
+written a buffer at a time, and the last buffer when the process exits;
+one that calls exec or _exit loses what it had not yet written.
+
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#define TRACE_SLOTS  (1 << 16)  // first size of the pointer table
+#define SPARE_VARS   (1 << 14)  // first size of the spare variable stack
+#define OUT_BUFFER   (1 << 16)  // bytes of script written at a time
+#define MAX_LINE     64         // longest line of script
+#define NO_VAR       0xFFFFFFFF
+
+#define TRUE  1
+#define FALSE 0
+
+// glibc's own allocator, behind the standard names
+extern void *__libc_malloc(size_t n);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *object, size_t n);
+extern void *__libc_memalign(size_t alignment, size_t n);
+extern void __libc_free(void *object);
+
+// a live pointer and its variable (object NULL = empty slot)
+typedef struct {
+    void *object;
+    u_int32_t var;
+} slot_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t started = PTHREAD_ONCE_INIT;
+static _Thread_local int inside;     // TRUE while this thread is in the tracer
+
+static char path[PATH_MAX];          // PREFIX. (emit adds the pid)
+static int out = -1;                 // trace file (-1 = not open yet)
+static int off;                      // TRUE once nothing more is to be recorded
+static char buffer[OUT_BUFFER];
+static u_int32_t buffered;
+
+static slot_t *table;                // open addressing, linear probing
+static u_int32_t slots;              // # entries in table[] (a power of two)
+static u_int32_t count;              // # of them in use
+static u_int32_t *spare;             // freed variable numbers, for reuse
+static u_int32_t spare_count;
+static u_int32_t spare_slots;
+static u_int32_t next_var;           // lowest number never used
+
+static void record(char op, void *object, void *moved, size_t alignment, size_t n);
+static void startTrace(void);
+static void lockTrace(void);
+static void unlockTrace(void);
+static void restartTrace(void);
+static void finishTrace(void) __attribute__((destructor));
+static void emit(const char *line, u_int32_t length);
+static char *putNumber(char *s, size_t value);
+static u_int32_t newVar(void);
+static int addVar(void *object, u_int32_t var);
+static u_int32_t dropVar(void *object);
+static int growTable(void);
+static u_int32_t traceHash(void *object);
+
+void *malloc(size_t n)
+{
+    void *object = __libc_malloc(n);
+    record('+', object, NULL, 0, n);
+    return object;
+}
+
+void free(void *object)
+{
+    if(object != NULL){
+        record('-', object, NULL, 0, 0);
+    }
+    __libc_free(object);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *object = __libc_calloc(nmemb, size);
+    record('c', object, NULL, 0, nmemb * size);
+    return object;
+}
+
+void *realloc(void *object, size_t n)
+{
+    if(object == NULL) return malloc(n);
+
+    void *moved = __libc_realloc(object, n);
+    if(n == 0){
+        record('-', object, NULL, 0, 0);
+    } else if(moved != NULL){
+        record('r', object, moved, 0, n);
+    }
+    return moved;
+}
+
+int posix_memalign(void **result, size_t alignment, size_t n)
+{
+    if(alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0){
+        return EINVAL;
+    }
+    void *object = __libc_memalign(alignment, n);
+    if(object == NULL) return ENOMEM;
+    record('a', object, NULL, alignment, n);
+    *result = object;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t n)
+{
+    return memalign(alignment, n);
+}
+
+void *memalign(size_t alignment, size_t n)
+{
+    void *object = __libc_memalign(alignment, n);
+    record('a', object, NULL, alignment, n);
+    return object;
+}
+
+// Input: op - the vlad command for the call ('+', 'c', 'a', 'r' or '-')
+//        object - the block it returned (or freed, or resized)
+//        moved - where a resized block is now
+//        alignment, n - as passed to the call
+// Postcondition: the call is in the trace, if it is to be recorded
+
+static void record(char op, void *object, void *moved, size_t alignment, size_t n)
+{
+    if(object == NULL || inside) return;
+
+    inside = 1;
+    pthread_once(&started, startTrace);
+    pthread_mutex_lock(&lock);
+    if(!off){
+        char line[MAX_LINE];
+        char *s = line;
+        u_int32_t var = NO_VAR;
+        if(op == '+' || op == 'c' || op == 'a'){
+            // a block freed where the tracer did not see it
+            u_int32_t stale = dropVar(object);
+            if(stale != NO_VAR){
+                spare[spare_count++] = stale;
+                *s++ = '-';
+                *s++ = ' ';
+                s = putNumber(s, stale);
+                *s++ = '\n';
+            }
+            if(n <= INT_MAX){
+                var = newVar();
+                if(var != NO_VAR && !addVar(object, var)){
+                    var = NO_VAR;
+                }
+                off = (var == NO_VAR);
+            }
+        } else {
+            // a resized block keeps its variable
+            var = dropVar(object);
+            if(var != NO_VAR && op == 'r' && n > INT_MAX){
+                op = '-';
+            }
+            if(var != NO_VAR && op == '-'){
+                spare[spare_count++] = var;
+            } else if(var != NO_VAR && !addVar(moved, var)){
+                off = TRUE;
+            }
+        }
+
+        if(var != NO_VAR && !off){
+            *s++ = op;
+            *s++ = ' ';
+            s = putNumber(s, var);
+            if(op == 'a'){
+                *s++ = ' ';
+                s = putNumber(s, alignment);
+            }
+            if(op != '-'){
+                *s++ = ' ';
+                s = putNumber(s, n);
+            }
+            *s++ = '\n';
+        }
+        emit(line, s - line);
+    }
+    pthread_mutex_unlock(&lock);
+    inside = 0;
+}
+
+// Postcondition: recording is on if the environment asks for it, with
+//                an empty table, and children will start their own trace
+
+static void startTrace(void)
+{
+    const char *prefix = getenv("VLAD_TRACE");
+    if(prefix == NULL || *prefix == '\0' || strlen(prefix) + 1 + 20 >= PATH_MAX
+       || !growTable()){
+        off = TRUE;
+        return;
+    }
+    strcpy(path, prefix);
+    strcat(path, ".");
+    pthread_atfork(lockTrace, unlockTrace, restartTrace);
+}
+
+static void lockTrace(void)
+{
+    pthread_mutex_lock(&lock);
+}
+
+static void unlockTrace(void)
+{
+    pthread_mutex_unlock(&lock);
+}
+
+// Postcondition: (in a child just forked) the parent's file, buffer and
+//                variables are forgotten, and the lock is free
+
+static void restartTrace(void)
+{
+    out = -1;
+    buffered = 0;
+    memset(table, 0, slots * sizeof(slot_t));
+    count = 0;
+    spare_count = 0;
+    next_var = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+// Postcondition: everything recorded is in the trace file
+
+static void finishTrace(void)
+{
+    pthread_mutex_lock(&lock);
+    emit(NULL, 0);
+    pthread_mutex_unlock(&lock);
+}
+
+// Input: line, length - script to add to the trace (NULL = none)
+// Postcondition: it is in buffer[] or written out, as is everything
+//                before it; with line NULL, buffer[] has been written out
+// Precondition: the caller holds the lock
+
+static void emit(const char *line, u_int32_t length)
+{
+    if(line != NULL && buffered + length <= OUT_BUFFER){
+        memcpy(buffer + buffered, line, length);
+        buffered += length;
+        return;
+    }
+
+    if(out < 0 && buffered > 0){
+        char name[PATH_MAX];
+        *putNumber(stpcpy(name, path), getpid()) = '\0';
+        out = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if(out >= 0){
+        u_int32_t done = 0;
+        while(done < buffered){
+            ssize_t written = write(out, buffer + done, buffered - done);
+            if(written <= 0) break;
+            done += written;
+        }
+    }
+    buffered = 0;
+    if(line != NULL){
+        memcpy(buffer, line, length);
+        buffered = length;
+    }
+}
+
+// Output: the position after value, written in decimal at s
+
+static char *putNumber(char *s, size_t value)
+{
+    char digits[20];
+    int n = 0;
+    do{
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while(value > 0);
+    while(n > 0){
+        *s++ = digits[--n];
+    }
+    return s;
+}
+
+// Output: a variable number not in use, or NO_VAR if there was no memory
+// Precondition: the caller holds the lock
+
+static u_int32_t newVar(void)
+{
+    if(spare_count > 0) return spare[--spare_count];
+
+    // the most that can be spare is every number handed out so far
+    if(next_var == spare_slots){
+        u_int32_t more = spare_slots > 0 ? 2 * spare_slots : SPARE_VARS;
+        u_int32_t *grown = mmap(NULL, more * sizeof(u_int32_t), PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(grown == MAP_FAILED) return NO_VAR;
+        if(spare_slots > 0){
+            memcpy(grown, spare, spare_count * sizeof(u_int32_t));
+            munmap(spare, spare_slots * sizeof(u_int32_t));
+        }
+        spare = grown;
+        spare_slots = more;
+    }
+    return next_var++;
+}
+
+// Input: object - a pointer not in table[]; var - its variable
+// Output: TRUE, or FALSE if the table was full and could not grow
+// Precondition: the caller holds the lock
+
+static int addVar(void *object, u_int32_t var)
+{
+    // keep the table at most half full, so that probes stay short
+    if(2 * (count + 1) > slots && !growTable()) return FALSE;
+
+    u_int32_t mask = slots - 1;
+    u_int32_t i = traceHash(object) & mask;
+    while(table[i].object != NULL){
+        i = (i + 1) & mask;
+    }
+    table[i].object = object;
+    table[i].var = var;
+    count++;
+    return TRUE;
+}
+
+// Input: object - any pointer
+// Output: its variable, or NO_VAR if it had none
+// Postcondition: object is not in table[], and the entries after it
+//                that would no longer be found by a linear probe have
+//                moved back (as in allocator.c's dropHuge)
+// Precondition: the caller holds the lock
+
+static u_int32_t dropVar(void *object)
+{
+    u_int32_t mask = slots - 1;
+    u_int32_t i = traceHash(object) & mask;
+    while(table[i].object != object){
+        if(table[i].object == NULL) return NO_VAR;
+        i = (i + 1) & mask;
+    }
+    u_int32_t var = table[i].var;
+    count--;
+
+    u_int32_t j = i;
+    for(;;){
+        table[i].object = NULL;
+        u_int32_t home;
+        do{
+            j = (j + 1) & mask;
+            if(table[j].object == NULL) return var;
+            home = traceHash(table[j].object) & mask;
+        } while(i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        table[i] = table[j];
+        i = j;
+    }
+}
+
+// Output: TRUE if table[] now has twice as many entries (or its first
+//         TRACE_SLOTS), FALSE if mmap failed and it is unchanged
+//
+// mmap'd, so that growing it never calls malloc.
+
+static int growTable(void)
+{
+    u_int32_t more = slots > 0 ? 2 * slots : TRACE_SLOTS;
+    slot_t *grown = mmap(NULL, more * sizeof(slot_t), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(grown == MAP_FAILED) return FALSE;
+
+    u_int32_t i;
+    for(i = 0; i < slots; i++){
+        if(table[i].object == NULL) continue;
+        u_int32_t j = traceHash(table[i].object) & (more - 1);
+        while(grown[j].object != NULL){
+            j = (j + 1) & (more - 1);
+        }
+        grown[j] = table[i];
+    }
+    if(slots > 0){
+        munmap(table, slots * sizeof(slot_t));
+    }
+    table = grown;
+    slots = more;
+    return TRUE;
+}
+
+static u_int32_t traceHash(void *object)
+{
+    return ((u_int64_t) (uintptr_t) object * 0x9E3779B97F4A7C15ULL) >> 32;
+}